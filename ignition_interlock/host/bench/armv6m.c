@@ -0,0 +1,540 @@
+/**
+ * @file    armv6m.c
+ * @brief   Small ARMv6-M (Cortex-M0+) instruction interpreter with cycle counts.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "armv6m.h"
+
+#define PAGE_SHIFT (12)
+#define PAGE_SIZE (1u << PAGE_SHIFT)
+#define MAX_PAGES (1024) // Must be a power of 2
+
+#define SP (13)
+#define LR (14)
+#define PC (15)
+
+// Cortex-M0+ TRM, zero wait states
+#define CYC_ALU (1)
+#define CYC_MUL (1) // Single-cycle multiplier option
+#define CYC_MEM (2)
+#define CYC_BRANCH (2) // B, taken B<cond>, BX, BLX, ADD/MOV to PC
+#define CYC_BL (3)
+#define CYC_POP_PC (3) // POP {..., PC}: plus one per low register
+#define CYC_SYS (3) // MRS, MSR, DMB, DSB, ISB
+
+struct armv6m_mem {
+	uint32_t page[MAX_PAGES];
+	uint8_t *data[MAX_PAGES];
+};
+
+armv6m_mem_t *armv6m_mem_new(void)
+{
+	return calloc(1, sizeof(armv6m_mem_t));
+}
+
+void armv6m_mem_free(armv6m_mem_t *mem)
+{
+	if (mem) {
+		for (uint32_t i = 0; i < MAX_PAGES; i++) {
+			free(mem->data[i]);
+		}
+		free(mem);
+	}
+}
+
+static uint8_t *page_of(armv6m_mem_t *mem, uint32_t addr, int create)
+{
+	uint32_t page = addr >> PAGE_SHIFT;
+	uint32_t i = (page * 2654435761u) & (MAX_PAGES - 1);
+
+	while (mem->data[i]) {
+		if (mem->page[i] == page) {
+			return mem->data[i];
+		}
+		i = (i + 1) & (MAX_PAGES - 1);
+	}
+	if (!create) {
+		return 0;
+	}
+	mem->page[i] = page;
+	mem->data[i] = calloc(1, PAGE_SIZE);
+	return mem->data[i];
+}
+
+uint32_t armv6m_read(armv6m_mem_t *mem, uint32_t addr, uint32_t size)
+{
+	uint32_t value = 0;
+
+	for (uint32_t i = 0; i < size; i++) {
+		uint8_t *p = page_of(mem, addr + i, 0);
+
+		if (p) {
+			value |= (uint32_t)p[(addr + i) & (PAGE_SIZE - 1)] << (8 * i);
+		}
+	}
+	return value;
+}
+
+void armv6m_write(armv6m_mem_t *mem, uint32_t addr, uint32_t size, uint32_t value)
+{
+	for (uint32_t i = 0; i < size; i++) {
+		page_of(mem, addr + i, 1)[(addr + i) & (PAGE_SIZE - 1)] = (uint8_t)(value >> (8 * i));
+	}
+}
+
+void armv6m_load(armv6m_mem_t *mem, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		armv6m_write(mem, addr + i, 1, data[i]);
+	}
+}
+
+static void set_nz(armv6m_t *cpu, uint32_t result)
+{
+	cpu->n = result >> 31;
+	cpu->z = (result == 0);
+}
+
+static uint32_t add_with_carry(armv6m_t *cpu, uint32_t a, uint32_t b, uint32_t carry, int setflags)
+{
+	uint64_t usum = (uint64_t)a + b + carry;
+	int64_t ssum = (int64_t)(int32_t)a + (int32_t)b + carry;
+	uint32_t result = (uint32_t)usum;
+
+	if (setflags) {
+		set_nz(cpu, result);
+		cpu->c = (uint32_t)(usum >> 32) & 1;
+		cpu->v = ((int64_t)(int32_t)result != ssum);
+	}
+	return result;
+}
+
+static int condition(armv6m_t *cpu, uint32_t cond)
+{
+	switch (cond) {
+	case 0x0: return cpu->z;
+	case 0x1: return !cpu->z;
+	case 0x2: return cpu->c;
+	case 0x3: return !cpu->c;
+	case 0x4: return cpu->n;
+	case 0x5: return !cpu->n;
+	case 0x6: return cpu->v;
+	case 0x7: return !cpu->v;
+	case 0x8: return cpu->c && !cpu->z;
+	case 0x9: return !cpu->c || cpu->z;
+	case 0xA: return cpu->n == cpu->v;
+	case 0xB: return cpu->n != cpu->v;
+	case 0xC: return !cpu->z && (cpu->n == cpu->v);
+	case 0xD: return cpu->z || (cpu->n != cpu->v);
+	default: return 1;
+	}
+}
+
+// Register-specified shifts: amount is the bottom byte of Rs
+static uint32_t shift_reg(armv6m_t *cpu, uint32_t op, uint32_t value, uint32_t amount)
+{
+	amount &= 0xFF;
+	if (amount == 0) {
+		return value;
+	}
+	switch (op) {
+	case 0:	// LSL
+		cpu->c = (amount <= 32) ? ((value >> (32 - amount)) & 1) : 0;
+		return (amount < 32) ? (value << amount) : 0;
+	case 1:	// LSR
+		cpu->c = (amount <= 32) ? ((value >> (amount - 1)) & 1) : 0;
+		return (amount < 32) ? (value >> amount) : 0;
+	case 2:	// ASR
+		if (amount >= 32) {
+			cpu->c = value >> 31;
+			return (uint32_t)((int32_t)value >> 31);
+		}
+		cpu->c = (value >> (amount - 1)) & 1;
+		return (uint32_t)((int32_t)value >> amount);
+	default:	// ROR
+		amount &= 31;
+		if (amount != 0) {
+			value = (value >> amount) | (value << (32 - amount));
+		}
+		cpu->c = value >> 31;
+		return value;
+	}
+}
+
+static uint32_t sign_extend(uint32_t value, uint32_t bits)
+{
+	uint32_t m = 1u << (bits - 1);
+
+	return (value ^ m) - m;
+}
+
+static int is_return(uint32_t target)
+{
+	return (target & 0xFFFFFFF0u) == 0xFFFFFFF0u;
+}
+
+static uint32_t read_special(armv6m_t *cpu, uint32_t sysm)
+{
+	if (sysm <= 7) {	// xPSR views: only the flags are kept
+		return (cpu->n << 31) | (cpu->z << 30) | (cpu->c << 29) | (cpu->v << 28);
+	}
+	if ((sysm == 8) || (sysm == 9)) {
+		return cpu->r[SP];
+	}
+	if (sysm == 16) {
+		return cpu->primask;
+	}
+	return 0;
+}
+
+static void write_special(armv6m_t *cpu, uint32_t sysm, uint32_t value)
+{
+	if (sysm <= 3) {
+		cpu->n = (value >> 31) & 1;
+		cpu->z = (value >> 30) & 1;
+		cpu->c = (value >> 29) & 1;
+		cpu->v = (value >> 28) & 1;
+	} else if ((sysm == 8) || (sysm == 9)) {
+		cpu->r[SP] = value & ~3u;
+	} else if (sysm == 16) {
+		cpu->primask = value & 1;
+	}
+}
+
+// Executes one instruction; returns 1 when the outermost call has returned
+static int step(armv6m_t *cpu, armv6m_mem_t *mem, int *error)
+{
+	uint32_t *r = cpu->r;
+	uint32_t pc = r[PC];
+	uint32_t op = armv6m_read(mem, pc, 2);
+	uint32_t next = pc + 2;
+	uint32_t pcval = pc + 4;	// PC as read by the instruction
+	uint32_t cycles = CYC_ALU;
+	uint32_t rd = op & 7;
+	uint32_t rn = (op >> 3) & 7;
+	uint32_t rm = (op >> 6) & 7;
+	uint32_t imm5 = (op >> 6) & 0x1F;
+	uint32_t target = 0;
+	int branch = 0;
+
+	cpu->insns++;
+	switch (op >> 11) {
+	case 0x00:	// LSL (immediate), MOVS when imm5 == 0
+		if (imm5 != 0) {
+			cpu->c = (r[rn] >> (32 - imm5)) & 1;
+		}
+		r[rd] = r[rn] << imm5;
+		set_nz(cpu, r[rd]);
+		break;
+	case 0x01:	// LSR (immediate)
+		imm5 = imm5 ? imm5 : 32;
+		cpu->c = (r[rn] >> (imm5 - 1)) & 1;
+		r[rd] = (imm5 < 32) ? (r[rn] >> imm5) : 0;
+		set_nz(cpu, r[rd]);
+		break;
+	case 0x02:	// ASR (immediate)
+		imm5 = imm5 ? imm5 : 32;
+		cpu->c = (r[rn] >> (imm5 - 1)) & 1;
+		r[rd] = (uint32_t)((int32_t)r[rn] >> ((imm5 < 32) ? imm5 : 31));
+		set_nz(cpu, r[rd]);
+		break;
+	case 0x03: {	// ADD/SUB, register or 3-bit immediate
+		uint32_t operand = (op & (1 << 10)) ? rm : r[rm];
+
+		if (op & (1 << 9)) {
+			r[rd] = add_with_carry(cpu, r[rn], ~operand, 1, 1);
+		} else {
+			r[rd] = add_with_carry(cpu, r[rn], operand, 0, 1);
+		}
+		break;
+	}
+	case 0x04:	// MOV (immediate)
+		r[(op >> 8) & 7] = op & 0xFF;
+		set_nz(cpu, op & 0xFF);
+		break;
+	case 0x05:	// CMP (immediate)
+		add_with_carry(cpu, r[(op >> 8) & 7], ~(op & 0xFF), 1, 1);
+		break;
+	case 0x06:	// ADD (8-bit immediate)
+		r[(op >> 8) & 7] = add_with_carry(cpu, r[(op >> 8) & 7], op & 0xFF, 0, 1);
+		break;
+	case 0x07:	// SUB (8-bit immediate)
+		r[(op >> 8) & 7] = add_with_carry(cpu, r[(op >> 8) & 7], ~(op & 0xFF), 1, 1);
+		break;
+	case 0x08:
+		if ((op & 0x0400) == 0) {	// Data processing, low registers
+			uint32_t a = r[rd];
+			uint32_t b = r[rn];
+
+			switch ((op >> 6) & 0xF) {
+			case 0x0: r[rd] = a & b; set_nz(cpu, r[rd]); break;
+			case 0x1: r[rd] = a ^ b; set_nz(cpu, r[rd]); break;
+			case 0x2: r[rd] = shift_reg(cpu, 0, a, b); set_nz(cpu, r[rd]); break;
+			case 0x3: r[rd] = shift_reg(cpu, 1, a, b); set_nz(cpu, r[rd]); break;
+			case 0x4: r[rd] = shift_reg(cpu, 2, a, b); set_nz(cpu, r[rd]); break;
+			case 0x5: r[rd] = add_with_carry(cpu, a, b, cpu->c, 1); break;
+			case 0x6: r[rd] = add_with_carry(cpu, a, ~b, cpu->c, 1); break;
+			case 0x7: r[rd] = shift_reg(cpu, 3, a, b); set_nz(cpu, r[rd]); break;
+			case 0x8: set_nz(cpu, a & b); break;
+			case 0x9: r[rd] = add_with_carry(cpu, ~b, 0, 1, 1); break;	// RSBS #0
+			case 0xA: add_with_carry(cpu, a, ~b, 1, 1); break;
+			case 0xB: add_with_carry(cpu, a, b, 0, 1); break;
+			case 0xC: r[rd] = a | b; set_nz(cpu, r[rd]); break;
+			case 0xD: r[rd] = a * b; set_nz(cpu, r[rd]); cycles = CYC_MUL; break;
+			case 0xE: r[rd] = a & ~b; set_nz(cpu, r[rd]); break;
+			default: r[rd] = ~b; set_nz(cpu, r[rd]); break;
+			}
+		} else if ((op & 0x0300) != 0x0300) {	// ADD, CMP, MOV, high registers
+			uint32_t d = ((op >> 4) & 8) | rd;
+			uint32_t m = (op >> 3) & 0xF;
+			uint32_t value = (m == PC) ? pcval : r[m];
+
+			switch ((op >> 8) & 3) {
+			case 0:
+				value += (d == PC) ? pcval : r[d];
+				break;
+			case 1:
+				add_with_carry(cpu, (d == PC) ? pcval : r[d], ~value, 1, 1);
+				d = 16;	// no destination
+				break;
+			default:
+				break;
+			}
+			if (d == PC) {
+				target = value;
+				branch = 1;
+			} else if (d < 16) {
+				r[d] = value;
+			}
+		} else {	// BX, BLX
+			target = r[(op >> 3) & 0xF];
+			if (op & 0x80) {
+				r[LR] = next | 1;
+			}
+			branch = 1;
+		}
+		break;
+	case 0x09:	// LDR (literal)
+		r[(op >> 8) & 7] = armv6m_read(mem, (pcval & ~3u) + ((op & 0xFF) << 2), 4);
+		cycles = CYC_MEM;
+		break;
+	case 0x0A:
+	case 0x0B: {	// Load/store, register offset
+		uint32_t addr = r[rn] + r[rm];
+
+		cycles = CYC_MEM;
+		switch ((op >> 9) & 7) {
+		case 0: armv6m_write(mem, addr, 4, r[rd]); break;
+		case 1: armv6m_write(mem, addr, 2, r[rd]); break;
+		case 2: armv6m_write(mem, addr, 1, r[rd]); break;
+		case 3: r[rd] = sign_extend(armv6m_read(mem, addr, 1), 8); break;
+		case 4: r[rd] = armv6m_read(mem, addr, 4); break;
+		case 5: r[rd] = armv6m_read(mem, addr, 2); break;
+		case 6: r[rd] = armv6m_read(mem, addr, 1); break;
+		default: r[rd] = sign_extend(armv6m_read(mem, addr, 2), 16); break;
+		}
+		break;
+	}
+	case 0x0C: armv6m_write(mem, r[rn] + (imm5 << 2), 4, r[rd]); cycles = CYC_MEM; break;
+	case 0x0D: r[rd] = armv6m_read(mem, r[rn] + (imm5 << 2), 4); cycles = CYC_MEM; break;
+	case 0x0E: armv6m_write(mem, r[rn] + imm5, 1, r[rd]); cycles = CYC_MEM; break;
+	case 0x0F: r[rd] = armv6m_read(mem, r[rn] + imm5, 1); cycles = CYC_MEM; break;
+	case 0x10: armv6m_write(mem, r[rn] + (imm5 << 1), 2, r[rd]); cycles = CYC_MEM; break;
+	case 0x11: r[rd] = armv6m_read(mem, r[rn] + (imm5 << 1), 2); cycles = CYC_MEM; break;
+	case 0x12:	// STR (SP relative)
+		armv6m_write(mem, r[SP] + ((op & 0xFF) << 2), 4, r[(op >> 8) & 7]);
+		cycles = CYC_MEM;
+		break;
+	case 0x13:	// LDR (SP relative)
+		r[(op >> 8) & 7] = armv6m_read(mem, r[SP] + ((op & 0xFF) << 2), 4);
+		cycles = CYC_MEM;
+		break;
+	case 0x14:	// ADR
+		r[(op >> 8) & 7] = (pcval & ~3u) + ((op & 0xFF) << 2);
+		break;
+	case 0x15:	// ADD (SP plus immediate)
+		r[(op >> 8) & 7] = r[SP] + ((op & 0xFF) << 2);
+		break;
+	case 0x16:
+	case 0x17:	// Miscellaneous
+		if ((op & 0xFF00) == 0xB000) {	// ADD/SUB SP, SP, #imm7
+			r[SP] += (op & 0x80) ? -((op & 0x7F) << 2) : ((op & 0x7F) << 2);
+		} else if ((op & 0xFF00) == 0xB200) {	// SXTH, SXTB, UXTH, UXTB
+			switch ((op >> 6) & 3) {
+			case 0: r[rd] = sign_extend(r[rn] & 0xFFFF, 16); break;
+			case 1: r[rd] = sign_extend(r[rn] & 0xFF, 8); break;
+			case 2: r[rd] = r[rn] & 0xFFFF; break;
+			default: r[rd] = r[rn] & 0xFF; break;
+			}
+		} else if ((op & 0xFE00) == 0xB400) {	// PUSH
+			uint32_t list = (op & 0xFF) | ((op & 0x100) << 6);
+			uint32_t addr = r[SP] - 4 * (uint32_t)__builtin_popcount(list);
+
+			r[SP] = addr;
+			for (uint32_t i = 0; i < 16; i++) {
+				if (list & (1u << i)) {
+					armv6m_write(mem, addr, 4, r[i]);
+					addr += 4;
+				}
+			}
+			cycles = 1 + (uint32_t)__builtin_popcount(list);
+		} else if ((op & 0xFFEF) == 0xB662) {	// CPSIE i / CPSID i
+			cpu->primask = (op >> 4) & 1;
+		} else if ((op & 0xFF00) == 0xBA00) {	// REV, REV16, REVSH
+			uint32_t v = r[rn];
+
+			switch ((op >> 6) & 3) {
+			case 0: r[rd] = __builtin_bswap32(v); break;
+			case 1: r[rd] = ((v & 0x00FF00FFu) << 8) | ((v >> 8) & 0x00FF00FFu); break;
+			case 3: r[rd] = sign_extend(((v & 0xFF) << 8) | ((v >> 8) & 0xFF), 16); break;
+			default: *error = ARMV6M_UNDEFINED; return 1;
+			}
+		} else if ((op & 0xFE00) == 0xBC00) {	// POP
+			uint32_t addr = r[SP];
+			uint32_t lows = (uint32_t)__builtin_popcount(op & 0xFF);
+
+			for (uint32_t i = 0; i < 8; i++) {
+				if (op & (1u << i)) {
+					r[i] = armv6m_read(mem, addr, 4);
+					addr += 4;
+				}
+			}
+			cycles = 1 + lows;
+			if (op & 0x100) {
+				target = armv6m_read(mem, addr, 4);
+				addr += 4;
+				branch = 1;
+				cycles = CYC_POP_PC + lows;
+			}
+			r[SP] = addr;
+		} else if ((op & 0xFF0F) == 0xBF00) {	// NOP, YIELD, WFE, WFI, SEV
+			break;
+		} else {	// BKPT and unallocated
+			*error = ARMV6M_UNDEFINED;
+			return 1;
+		}
+		break;
+	case 0x18: {	// STM
+		uint32_t base = (op >> 8) & 7;
+		uint32_t addr = r[base];
+
+		for (uint32_t i = 0; i < 8; i++) {
+			if (op & (1u << i)) {
+				armv6m_write(mem, addr, 4, r[i]);
+				addr += 4;
+			}
+		}
+		r[base] = addr;
+		cycles = 1 + (uint32_t)__builtin_popcount(op & 0xFF);
+		break;
+	}
+	case 0x19: {	// LDM, writeback unless the base is loaded
+		uint32_t base = (op >> 8) & 7;
+		uint32_t addr = r[base];
+
+		for (uint32_t i = 0; i < 8; i++) {
+			if (op & (1u << i)) {
+				r[i] = armv6m_read(mem, addr, 4);
+				addr += 4;
+			}
+		}
+		if (!(op & (1u << base))) {
+			r[base] = addr;
+		}
+		cycles = 1 + (uint32_t)__builtin_popcount(op & 0xFF);
+		break;
+	}
+	case 0x1A:
+	case 0x1B: {	// B<cond>, UDF, SVC
+		uint32_t cond = (op >> 8) & 0xF;
+
+		if (cond >= 0xE) {
+			*error = ARMV6M_UNDEFINED;
+			return 1;
+		}
+		if (condition(cpu, cond)) {
+			target = pcval + (sign_extend(op & 0xFF, 8) << 1);
+			branch = 1;
+		}
+		break;
+	}
+	case 0x1C:	// B
+		target = pcval + (sign_extend(op & 0x7FF, 11) << 1);
+		branch = 1;
+		break;
+	case 0x1E: {	// 32-bit: BL, MSR, MRS, barriers
+		uint32_t op2 = armv6m_read(mem, pc + 2, 2);
+
+		next = pc + 4;
+		if ((op2 & 0xD000) == 0xD000) {	// BL
+			uint32_t s = (op >> 10) & 1;
+			uint32_t i1 = !(((op2 >> 13) & 1) ^ s);
+			uint32_t i2 = !(((op2 >> 11) & 1) ^ s);
+			uint32_t offset = (s << 24) | (i1 << 23) | (i2 << 22) | ((op & 0x3FF) << 12) | ((op2 & 0x7FF) << 1);
+
+			r[LR] = next | 1;
+			target = next + sign_extend(offset, 25);
+			branch = 1;
+			cycles = CYC_BL;
+			break;
+		}
+		cycles = CYC_SYS;
+		if (((op & 0xFFF0) == 0xF380) && ((op2 & 0xFF00) == 0x8800)) {
+			write_special(cpu, op2 & 0xFF, r[op & 0xF]);
+		} else if ((op == 0xF3EF) && ((op2 & 0xF000) == 0x8000)) {
+			r[(op2 >> 8) & 0xF] = read_special(cpu, op2 & 0xFF);
+		} else if ((op == 0xF3BF) && ((op2 & 0xFFC0) == 0x8F40)) {
+			// DSB, DMB, ISB
+		} else {
+			*error = ARMV6M_UNDEFINED;
+			return 1;
+		}
+		break;
+	}
+	default:	// 0x1D, 0x1F: 32-bit encodings ARMv6-M does not have
+		*error = ARMV6M_UNDEFINED;
+		return 1;
+	}
+
+	if (branch) {
+		if (cycles == CYC_ALU) {
+			cycles = CYC_BRANCH;
+		}
+		if (is_return(target)) {
+			cpu->cycles += cycles;
+			return 1;
+		}
+		next = target & ~1u;
+	}
+	cpu->cycles += cycles;
+	r[PC] = next;
+	return 0;
+}
+
+int armv6m_call(armv6m_t *cpu, armv6m_mem_t *mem, uint32_t fn, uint32_t sp,
+		const uint32_t *args, uint32_t nargs, uint32_t until, uint64_t max_cycles)
+{
+	int error = ARMV6M_OK;
+
+	memset(cpu, 0, sizeof(*cpu));
+	for (uint32_t i = 0; (i < nargs) && (i < 4); i++) {
+		cpu->r[i] = args[i];
+	}
+	cpu->r[SP] = sp & ~7u;
+	cpu->r[LR] = ARMV6M_RETURN;
+	cpu->r[PC] = fn & ~1u;
+
+	while (cpu->cycles < max_cycles) {
+		if (until && (cpu->r[PC] == (until & ~1u))) {
+			return ARMV6M_OK;
+		}
+		cpu->fault_pc = cpu->r[PC];
+		if (step(cpu, mem, &error)) {
+			return error;
+		}
+	}
+	return ARMV6M_TIMEOUT;
+}
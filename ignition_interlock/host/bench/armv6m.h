@@ -0,0 +1,47 @@
+/**
+ * @file    armv6m.h
+ * @brief   Small ARMv6-M (Cortex-M0+) instruction interpreter with cycle counts.
+ *
+ * Runs one function of a linked image to completion against a flat, sparse
+ * memory. Cycle costs follow the Cortex-M0+ TRM with zero flash wait states
+ * and the single-cycle multiplier. Exception entry and return are not
+ * modelled: handlers are called like functions.
+ */
+
+#ifndef ARMV6M_H_
+#define ARMV6M_H_
+
+#include <stdint.h>
+
+#define ARMV6M_RETURN (0xFFFFFFF9u) // LR of the outermost call, as EXC_RETURN
+
+enum {
+	ARMV6M_OK = 0,
+	ARMV6M_TIMEOUT,	// max_cycles reached
+	ARMV6M_UNDEFINED,	// UDF, BKPT, SVC or an encoding outside ARMv6-M
+};
+
+typedef struct {
+	uint32_t r[16];
+	uint32_t n, z, c, v;
+	uint32_t primask;
+	uint64_t cycles;
+	uint64_t insns;
+	uint32_t fault_pc;	// Instruction that stopped the run
+} armv6m_t;
+
+// Sparse byte-addressed memory, 4 KiB pages allocated on first write
+typedef struct armv6m_mem armv6m_mem_t;
+
+armv6m_mem_t *armv6m_mem_new(void);
+void armv6m_mem_free(armv6m_mem_t *mem);
+uint32_t armv6m_read(armv6m_mem_t *mem, uint32_t addr, uint32_t size);
+void armv6m_write(armv6m_mem_t *mem, uint32_t addr, uint32_t size, uint32_t value);
+void armv6m_load(armv6m_mem_t *mem, uint32_t addr, const uint8_t *data, uint32_t len);
+
+// Call fn (Thumb bit optional) with up to 4 arguments; r0 holds the result.
+// A nonzero until also ends the run, successfully, when it is about to execute.
+int armv6m_call(armv6m_t *cpu, armv6m_mem_t *mem, uint32_t fn, uint32_t sp,
+		const uint32_t *args, uint32_t nargs, uint32_t until, uint64_t max_cycles);
+
+#endif /* ARMV6M_H_ */
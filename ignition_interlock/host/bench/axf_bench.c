@@ -0,0 +1,334 @@
+/**
+ * @file    axf_bench.c
+ * @brief   Cycle counts of firmware functions in the real .axf, against a baseline.
+ *
+ * Usage: axf_bench [--update | --compare] <image.axf> <benchmarks.txt> <baseline.txt>
+ *
+ * Each benchmark loads the image afresh, presets registers and variables,
+ * calls one function through armv6m.c and records its cycles. Peripheral
+ * registers are plain memory: a benchmark scripts what the function reads.
+ * Boot ROM calls return at once and cost only the call and return. A weak
+ * symbol (a default handler from the startup code) counts as absent.
+ * A benchmark whose cycles went up, or that the baseline has but the image
+ * no longer does, fails the run. --update rewrites the baseline instead;
+ * --compare only reports, to set one build variant against another.
+ *
+ * benchmarks.txt, one per line:
+ *   <name> <symbol> [until=<symbol>] [needs=[!]<symbol>] [r0=<v>] .. [r3=<v>] [<addr>[:<size>]=<v>] ...
+ * where <addr> and <v> are numbers or symbols, optionally +offset. until=
+ * stops the run on reaching that function rather than on the return, for
+ * code that never returns (ResetISR); an image without it counts as absent.
+ * needs= counts the benchmark as absent unless the image has the symbol
+ * (with !, unless it lacks it), for builds that differ in a #define.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "armv6m.h"
+#include "elf_image.h"
+
+#define MAX_BENCH (64)
+#define MAX_TOKENS (32)
+#define MAX_LINE (512)
+#define MAX_CYCLES (50000000ull) // A polling loop that never ends
+#define STACK_TOP_ADDR (0x00000000u) // Vector table word 0: initial SP
+#define ROM_DRIVER_BASE (0x0F001FF8u) // See drivers/rom_api.h
+#define IAP_ENTRY (0x0F001FF0u) // FSL_FEATURE_SYSCON_IAP_ENTRY_LOCATION & ~1
+#define ROM_STUB (0x0F000000u) // BX LR: every boot ROM call returns at once
+#define ROM_API_TABLE (0x0F000100u) // LPC_ROM_API_T, every entry ROM_DRIVER_TABLE
+#define ROM_DRIVER_TABLE (0x0F000200u) // Every function is ROM_STUB
+#define ROM_TABLE_WORDS (64)
+#define THUMB_BX_LR (0x4770u)
+
+typedef struct {
+	char name[64];
+	uint64_t cycles;
+	uint64_t insns;
+	int status;	// -1 absent from the image, else armv6m_call() result
+} result_t;
+
+typedef struct {
+	char name[64];
+	uint64_t cycles;
+} baseline_t;
+
+// Boot ROM stand-in on top of the image
+static void map_image(armv6m_mem_t *mem)
+{
+	elf_map(mem);
+	for (uint32_t i = 0; i < ROM_TABLE_WORDS; i++) {
+		armv6m_write(mem, ROM_STUB + (i * 2), 2, THUMB_BX_LR);
+		armv6m_write(mem, ROM_API_TABLE + (i * 4), 4, ROM_DRIVER_TABLE);
+		armv6m_write(mem, ROM_DRIVER_TABLE + (i * 4), 4, ROM_STUB | 1);
+	}
+	armv6m_write(mem, IAP_ENTRY, 2, THUMB_BX_LR);
+	armv6m_write(mem, ROM_DRIVER_BASE, 4, ROM_API_TABLE);
+}
+
+// <number> or <symbol>, either optionally followed by +<number>
+static int parse_value(const char *text, uint32_t *value)
+{
+	char sym[128];
+	const char *plus = strchr(text, '+');
+	size_t len = plus ? (size_t)(plus - text) : strlen(text);
+	char *end;
+
+	if (len >= sizeof(sym)) {
+		return 0;
+	}
+	memcpy(sym, text, len);
+	sym[len] = 0;
+	*value = (uint32_t)strtoul(sym, &end, 0);
+	if ((*end != 0) && !elf_lookup(sym, value, 1)) {
+		return 0;
+	}
+	if (plus) {
+		*value += (uint32_t)strtoul(plus + 1, 0, 0);
+	}
+	return 1;
+}
+
+static int run_bench(char **tok, int ntok, result_t *res, int line)
+{
+	armv6m_mem_t *mem = armv6m_mem_new();
+	armv6m_t cpu;
+	uint32_t fn;
+	uint32_t until = 0;
+	uint32_t args[4] = {0};
+	uint32_t nargs = 0;
+
+	snprintf(res->name, sizeof(res->name), "%s", tok[0]);
+	if (!elf_lookup(tok[1], &fn, 0)) {
+		res->status = -1;
+		armv6m_mem_free(mem);
+		return 1;
+	}
+	for (int i = 2; i < ntok; i++) {
+		if (strncmp(tok[i], "needs=", 6) == 0) {
+			int negate = (tok[i][6] == '!');
+			uint32_t addr;
+
+			if ((elf_lookup(tok[i] + 6 + negate, &addr, 1) != 0) == negate) {
+				res->status = -1;
+				armv6m_mem_free(mem);
+				return 1;
+			}
+		}
+	}
+	map_image(mem);
+	for (int i = 2; i < ntok; i++) {
+		char *eq = strchr(tok[i], '=');
+		char *colon;
+		uint32_t addr;
+		uint32_t value;
+		uint32_t size = 4;
+
+		if (strncmp(tok[i], "until=", 6) == 0) {
+			if (!elf_lookup(tok[i] + 6, &until, 0)) {
+				res->status = -1;
+				armv6m_mem_free(mem);
+				return 1;
+			}
+			continue;
+		}
+		if (strncmp(tok[i], "needs=", 6) == 0) {
+			continue;
+		}
+		if (!eq || !parse_value(eq + 1, &value)) {
+			fprintf(stderr, "line %d: bad setting '%s'\n", line, tok[i]);
+			armv6m_mem_free(mem);
+			return 0;
+		}
+		*eq = 0;
+		if ((tok[i][0] == 'r') && (tok[i][1] >= '0') && (tok[i][1] <= '3') && (tok[i][2] == 0)) {
+			uint32_t n = (uint32_t)(tok[i][1] - '0');
+
+			args[n] = value;
+			nargs = (n + 1 > nargs) ? (n + 1) : nargs;
+			continue;
+		}
+		colon = strchr(tok[i], ':');
+		if (colon) {
+			*colon = 0;
+			size = (uint32_t)strtoul(colon + 1, 0, 0);
+		}
+		if (!parse_value(tok[i], &addr) || ((size != 1) && (size != 2) && (size != 4))) {
+			fprintf(stderr, "line %d: bad address '%s'\n", line, tok[i]);
+			armv6m_mem_free(mem);
+			return 0;
+		}
+		armv6m_write(mem, addr, size, value);
+	}
+
+	res->status = armv6m_call(&cpu, mem, fn, armv6m_read(mem, STACK_TOP_ADDR, 4),
+			args, nargs, until, MAX_CYCLES);
+	res->cycles = cpu.cycles;
+	res->insns = cpu.insns;
+	if (res->status != ARMV6M_OK) {
+		fprintf(stderr, "%s: %s at 0x%08x\n", res->name,
+				(res->status == ARMV6M_TIMEOUT) ? "no return" : "undefined instruction", cpu.fault_pc);
+	}
+	armv6m_mem_free(mem);
+	return 1;
+}
+
+static int split(char *text, char **tok)
+{
+	int n = 0;
+	char *hash = strchr(text, '#');
+
+	if (hash) {
+		*hash = 0;
+	}
+	for (char *t = strtok(text, " \t\r\n"); t && (n < MAX_TOKENS); t = strtok(0, " \t\r\n")) {
+		tok[n++] = t;
+	}
+	return n;
+}
+
+static int read_baseline(const char *path, baseline_t *base)
+{
+	FILE *f = fopen(path, "r");
+	char text[MAX_LINE];
+	int n = 0;
+
+	if (!f) {
+		return 0;
+	}
+	while (fgets(text, sizeof(text), f) && (n < MAX_BENCH)) {
+		char *tok[MAX_TOKENS];
+
+		if (split(text, tok) >= 2) {
+			snprintf(base[n].name, sizeof(base[n].name), "%s", tok[0]);
+			base[n].cycles = strtoull(tok[1], 0, 0);
+			n++;
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+static int write_baseline(const char *path, const char *axf, const result_t *res, int n)
+{
+	FILE *f = fopen(path, "w");
+	const char *slash = strrchr(axf, '/');
+
+	if (!f) {
+		return 0;
+	}
+	fprintf(f, "# Cycles per benchmark, written by axf_bench --update from %s\n", slash ? (slash + 1) : axf);
+	for (int i = 0; i < n; i++) {
+		if (res[i].status == ARMV6M_OK) {
+			fprintf(f, "%-24s %10llu\n", res[i].name, (unsigned long long)res[i].cycles);
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	static result_t res[MAX_BENCH];
+	static baseline_t base[MAX_BENCH];
+	char text[MAX_LINE];
+	int update = 0;
+	int compare = 0;
+	int nres = 0;
+	int nbase;
+	int failed = 0;
+	int unmeasured = 0;	// absent from the image and the baseline alike
+	int line = 0;
+	FILE *f;
+
+	if ((argc > 1) && ((strcmp(argv[1], "--update") == 0) || (strcmp(argv[1], "--compare") == 0))) {
+		update = (argv[1][2] == 'u');
+		compare = !update;
+		argv++;
+		argc--;
+	}
+	if (argc != 4) {
+		fprintf(stderr, "usage: axf_bench [--update | --compare] <image.axf> <benchmarks.txt> <baseline.txt>\n");
+		return EXIT_FAILURE;
+	}
+	if (!elf_load(argv[1])) {
+		fprintf(stderr, "%s: not an ARM ELF image\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	f = fopen(argv[2], "r");
+	if (!f) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+	while (fgets(text, sizeof(text), f) && (nres < MAX_BENCH)) {
+		char *tok[MAX_TOKENS];
+		int ntok = split(text, tok);
+
+		line++;
+		if (ntok == 0) {
+			continue;
+		}
+		if ((ntok < 2) || !run_bench(tok, ntok, &res[nres], line)) {
+			fprintf(stderr, "%s:%d: cannot run\n", argv[2], line);
+			fclose(f);
+			return EXIT_FAILURE;
+		}
+		nres++;
+	}
+	fclose(f);
+
+	if (update) {
+		if (!write_baseline(argv[3], argv[1], res, nres)) {
+			perror(argv[3]);
+			return EXIT_FAILURE;
+		}
+	}
+	nbase = read_baseline(argv[3], base);
+
+	printf("%-24s %10s %10s %10s %8s\n", "benchmark", "cycles", "insns", "baseline", "delta");
+	for (int i = 0; i < nres; i++) {
+		const baseline_t *b = 0;
+
+		for (int j = 0; j < nbase; j++) {
+			if (strcmp(base[j].name, res[i].name) == 0) {
+				b = &base[j];
+			}
+		}
+		if (res[i].status == -1) {
+			printf("%-24s %10s %10s", res[i].name, "absent", "-");
+		} else if (res[i].status != ARMV6M_OK) {
+			printf("%-24s %10s %10s", res[i].name, "failed", "-");
+			failed = 1;
+		} else {
+			printf("%-24s %10llu %10llu", res[i].name, (unsigned long long)res[i].cycles,
+					(unsigned long long)res[i].insns);
+		}
+		if (!b) {
+			printf(" %10s\n", "new");
+			unmeasured += (res[i].status == -1);
+			continue;
+		}
+		printf(" %10llu", (unsigned long long)b->cycles);
+		if (res[i].status == -1) {
+			printf(" %8s\n", compare ? "absent" : "REMOVED");
+			failed |= !compare;
+		} else if (res[i].status == ARMV6M_OK) {
+			long long delta = (long long)res[i].cycles - (long long)b->cycles;
+
+			printf(" %+8lld%s\n", delta, ((delta > 0) && !compare) ? "  REGRESSION" : "");
+			failed |= (delta > 0) && !compare;
+		} else {
+			printf("\n");
+		}
+	}
+	if (failed) {
+		printf("\ncycle counts regressed: fix them, or rerun with --update and commit the baseline\n");
+	}
+	if (unmeasured && !compare) {
+		printf("\n%d benchmarks were never measured: the image predates them. Rebuild it, rerun with "
+				"--update and commit the baseline\n", unmeasured);
+	}
+	elf_free();
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,590 @@
+/**
+ * @file    axf_stack.c
+ * @brief   Worst-case stack depth of the .axf, checked against the SRAM region.
+ *
+ * Usage: axf_stack [-v] <image.axf> <memory.ld> <stack.txt> <file.su>...
+ *
+ * The call graph is read from the BL and out-of-function B instructions of
+ * every function in the image; literal pools are skipped using the $d/$t
+ * mapping symbols. Each function's frame is its -fstack-usage figure, or,
+ * for library code built without it, every PUSH and SUB SP in its body
+ * added up. Roots are the vector table entries. An exception only preempts
+ * a strictly higher priority number, so the worst case is the thread depth
+ * plus, per priority level, the deepest handler and its exception frame.
+ *
+ * stack.txt says what the image alone cannot:
+ *   priority <handler> <n>            NVIC_SetPriority() done by the firmware
+ *   calls <function> <callee|=bytes>...   targets of its indirect calls
+ *   bound <function> <bytes>          depth proven by hand (bounded recursion)
+ *
+ * Recursion, an unresolved indirect call or a dynamic frame leaves the
+ * bound unproven, and that fails the run like an overflow does.
+ */
+
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "armv6m.h"
+#include "elf_image.h"
+
+#define MAX_FUNCS (512)
+#define MAX_CALLEES (32)
+#define MAX_MARKS (2048)
+#define MAX_LINE (512)
+#define EXCEPTION_FRAME (36) // r0-r3, r12, lr, pc, xPSR and 4 bytes of alignment
+#define PRIO_THREAD (1000)
+#define PRIO_NMI (-2)
+#define PRIO_HARDFAULT (-1)
+#define VECTOR_TABLE (0x00000000u)
+#define VECTOR_COUNT (48) // 16 system + 32 IRQ entries on the LPC802
+#define DEPTH_UNKNOWN (-1)
+
+enum {
+	FUNC_NEW = 0,
+	FUNC_VISITING,
+	FUNC_DONE,
+};
+
+typedef struct {
+	const char *name;
+	uint32_t start;
+	uint32_t end;
+	uint8_t bind;
+	int32_t frame;
+	int from_su;
+	int dynamic;	// SP moved by a register, or "dynamic" in the .su
+	int indirect;	// BLX Rm seen
+	int resolved;	// stack.txt lists the BLX targets
+	int32_t extra;	// Worst external callee from stack.txt (boot ROM)
+	int32_t bound;	// Depth proven by hand in stack.txt, 0 if none
+	uint32_t callees[MAX_CALLEES];
+	uint32_t ncallees;
+	int state;
+	int32_t depth;	// Frame plus worst callee, DEPTH_UNKNOWN if unproven
+	int32_t worst;	// Callee on the worst path, -1 for none
+	int priority;
+	int printed;
+} func_t;
+
+typedef struct {
+	uint32_t addr;
+	int data;
+} mark_t;
+
+static func_t funcs[MAX_FUNCS];
+static uint32_t nfuncs = 0;
+static mark_t marks[MAX_MARKS];
+static uint32_t nmarks = 0;
+static armv6m_mem_t *mem;
+static int verbose = 0;
+static int unproven = 0;
+
+static int func_at(uint32_t addr)
+{
+	addr &= ~1u;
+	for (uint32_t i = 0; i < nfuncs; i++) {
+		if ((addr >= funcs[i].start) && (addr < funcs[i].end)) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+static int func_named(const char *name)
+{
+	for (uint32_t i = 0; i < nfuncs; i++) {
+		if (strcmp(funcs[i].name, name) == 0) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+static int by_addr(const void *a, const void *b)
+{
+	uint32_t x = ((const mark_t *)a)->addr;
+	uint32_t y = ((const mark_t *)b)->addr;
+
+	return (x > y) - (x < y);
+}
+
+// Functions of the image, one per address, preferring the strong name
+static void read_functions(void)
+{
+	elf_symbol_t sym;
+
+	for (uint32_t i = 0; elf_symbol(i, &sym); i++) {
+		int f;
+
+		if ((sym.name[0] == '$') && (nmarks < MAX_MARKS)) {
+			marks[nmarks].addr = sym.value & ~1u;
+			marks[nmarks].data = (sym.name[1] == 'd');
+			nmarks++;
+			continue;
+		}
+		if (sym.type != STT_FUNC) {
+			continue;
+		}
+		f = func_at(sym.value);
+		if ((f >= 0) && (funcs[f].start == (sym.value & ~1u))) {
+			if ((funcs[f].bind == STB_WEAK) && (sym.bind != STB_WEAK)) {
+				funcs[f].name = sym.name;
+				funcs[f].bind = sym.bind;
+			}
+			continue;
+		}
+		if (nfuncs < MAX_FUNCS) {
+			func_t *fn = &funcs[nfuncs++];
+
+			memset(fn, 0, sizeof(*fn));
+			fn->name = sym.name;
+			fn->start = sym.value & ~1u;
+			fn->end = fn->start + (sym.size ? sym.size : 2);	// assembly stubs: sized below
+			fn->bind = sym.bind;
+			fn->frame = DEPTH_UNKNOWN;
+			fn->worst = -1;
+		}
+	}
+	qsort(marks, nmarks, sizeof(marks[0]), by_addr);
+
+	// An unsized symbol (Redlib's semihosting stubs) runs to the next function
+	for (uint32_t i = 0; i < nfuncs; i++) {
+		if ((funcs[i].end - funcs[i].start) == 2) {
+			uint32_t next = UINT32_MAX;
+
+			for (uint32_t j = 0; j < nfuncs; j++) {
+				if ((funcs[j].start > funcs[i].start) && (funcs[j].start < next)) {
+					next = funcs[j].start;
+				}
+			}
+			funcs[i].end = (next != UINT32_MAX) ? next : funcs[i].end;
+		}
+	}
+}
+
+static int is_data(uint32_t addr)
+{
+	int data = 0;
+
+	for (uint32_t i = 0; (i < nmarks) && (marks[i].addr <= addr); i++) {
+		data = marks[i].data;
+	}
+	return data;
+}
+
+static void add_callee(func_t *fn, int callee, uint32_t site)
+{
+	if (callee < 0) {
+		fprintf(stderr, "%s: call at 0x%04x leaves every function\n", fn->name, site);
+		unproven = 1;
+		return;
+	}
+	for (uint32_t i = 0; i < fn->ncallees; i++) {
+		if (fn->callees[i] == (uint32_t)callee) {
+			return;
+		}
+	}
+	if (fn->ncallees < MAX_CALLEES) {
+		fn->callees[fn->ncallees++] = (uint32_t)callee;
+	}
+}
+
+// Calls, tail calls and the frame size from the code itself
+static void scan_function(func_t *fn)
+{
+	int32_t frame = 0;
+
+	for (uint32_t pc = fn->start; pc < fn->end; pc += 2) {
+		uint32_t op;
+
+		if (is_data(pc)) {
+			continue;
+		}
+		op = armv6m_read(mem, pc, 2);
+		if ((op >> 11) >= 0x1D) {	// 32-bit: BL, MSR, MRS, barriers
+			uint32_t op2 = armv6m_read(mem, pc + 2, 2);
+
+			if (((op >> 11) == 0x1E) && ((op2 & 0xD000) == 0xD000)) {
+				uint32_t s = (op >> 10) & 1;
+				uint32_t i1 = !(((op2 >> 13) & 1) ^ s);
+				uint32_t i2 = !(((op2 >> 11) & 1) ^ s);
+				uint32_t offset = (s << 24) | (i1 << 23) | (i2 << 22) | ((op & 0x3FF) << 12) | ((op2 & 0x7FF) << 1);
+				uint32_t target = pc + 4 + (offset | ((s ? 0xFE000000u : 0)));
+
+				if ((target < fn->start) || (target >= fn->end)) {	// else a far jump
+					add_callee(fn, func_at(target), pc);
+				}
+			}
+			pc += 2;
+		} else if ((op & 0xFE00) == 0xB400) {	// PUSH
+			frame += 4 * __builtin_popcount(op & 0x1FF);
+		} else if ((op & 0xFF80) == 0xB080) {	// SUB SP, SP, #imm
+			frame += (int32_t)((op & 0x7F) << 2);
+		} else if ((op & 0xFF87) == 0x4485) {	// ADD SP, Rm
+			fn->dynamic = 1;
+		} else if ((op & 0xFF87) == 0x4780) {	// BLX Rm
+			fn->indirect = 1;
+		} else if (((op & 0xF000) == 0xD000) && (((op >> 8) & 0xF) < 0xE)) {	// B<cond>
+			uint32_t target = pc + 4 + ((((op & 0xFF) ^ 0x80) - 0x80) << 1);
+
+			if ((target < fn->start) || (target >= fn->end)) {
+				add_callee(fn, func_at(target), pc);
+			}
+		} else if ((op & 0xF800) == 0xE000) {	// B
+			uint32_t target = pc + 4 + ((((op & 0x7FF) ^ 0x400) - 0x400) << 1);
+
+			if ((target < fn->start) || (target >= fn->end)) {
+				add_callee(fn, func_at(target), pc);
+			}
+		}
+	}
+	if (!fn->from_su) {
+		fn->frame = frame;
+	}
+}
+
+// file:line:col:name<TAB>bytes<TAB>static|dynamic|dynamic,bounded
+static void read_su(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char text[MAX_LINE];
+
+	if (!f) {
+		perror(path);
+		unproven = 1;
+		return;
+	}
+	while (fgets(text, sizeof(text), f)) {
+		char *tab = strchr(text, '\t');
+		char *colon;
+		char *qualifier;
+		long bytes;
+		int i;
+
+		if (!tab) {
+			continue;
+		}
+		*tab = 0;
+		colon = strrchr(text, ':');
+		bytes = strtol(tab + 1, &qualifier, 10);
+		i = func_named(colon ? (colon + 1) : text);
+		if (i < 0) {
+			continue;	// inlined everywhere or dropped by --gc-sections
+		}
+		// A static function of the same name in two files: take the larger
+		if (!funcs[i].from_su || (bytes > funcs[i].frame)) {
+			funcs[i].frame = (int32_t)bytes;
+		}
+		funcs[i].from_su = 1;
+		if (strstr(qualifier, "dynamic") && !strstr(qualifier, "bounded")) {
+			funcs[i].dynamic = 1;
+		}
+	}
+	fclose(f);
+}
+
+static int read_config(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char text[MAX_LINE];
+	int line = 0;
+
+	if (!f) {
+		perror(path);
+		return 0;
+	}
+	while (fgets(text, sizeof(text), f)) {
+		char *tok[MAX_CALLEES + 2];
+		int ntok = 0;
+		char *hash = strchr(text, '#');
+		int fn;
+
+		line++;
+		if (hash) {
+			*hash = 0;
+		}
+		for (char *t = strtok(text, " \t\r\n"); t && (ntok < (MAX_CALLEES + 2)); t = strtok(0, " \t\r\n")) {
+			tok[ntok++] = t;
+		}
+		if (ntok == 0) {
+			continue;
+		}
+		fn = (ntok >= 2) ? func_named(tok[1]) : -1;
+		if (fn < 0) {
+			// Not in this image: the firmware no longer has it
+			if (ntok >= 2) {
+				fprintf(stderr, "%s:%d: %s is not in the image, ignored\n", path, line, tok[1]);
+			}
+			continue;
+		}
+		if ((strcmp(tok[0], "priority") == 0) && (ntok == 3)) {
+			funcs[fn].priority = atoi(tok[2]);
+		} else if ((strcmp(tok[0], "bound") == 0) && (ntok == 3)) {
+			funcs[fn].bound = (int32_t)atoi(tok[2]);
+		} else if ((strcmp(tok[0], "calls") == 0) && (ntok >= 3)) {
+			// Resolved only if every target is found
+			funcs[fn].resolved = 1;
+			for (int i = 2; i < ntok; i++) {
+				if (tok[i][0] == '=') {
+					int32_t bytes = (int32_t)atoi(tok[i] + 1);
+
+					funcs[fn].extra = (bytes > funcs[fn].extra) ? bytes : funcs[fn].extra;
+				} else if (func_named(tok[i]) >= 0) {
+					add_callee(&funcs[fn], func_named(tok[i]), funcs[fn].start);
+				} else {
+					fprintf(stderr, "%s:%d: %s is not in the image\n", path, line, tok[i]);
+					funcs[fn].resolved = 0;
+				}
+			}
+		} else {
+			fprintf(stderr, "%s:%d: unknown setting\n", path, line);
+			fclose(f);
+			return 0;
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
+static int32_t depth_of(uint32_t i)
+{
+	func_t *fn = &funcs[i];
+	int32_t worst = fn->extra;
+
+	if (fn->state == FUNC_DONE) {
+		return fn->depth;
+	}
+	if (fn->bound > 0) {
+		fn->depth = fn->bound;
+		fn->state = FUNC_DONE;
+		return fn->depth;
+	}
+	if (fn->state == FUNC_VISITING) {
+		fprintf(stderr, "%s: recursion, no bound\n", fn->name);
+		unproven = 1;
+		return DEPTH_UNKNOWN;
+	}
+	fn->state = FUNC_VISITING;
+	for (uint32_t c = 0; c < fn->ncallees; c++) {
+		int32_t d = depth_of(fn->callees[c]);
+
+		if (d == DEPTH_UNKNOWN) {
+			worst = DEPTH_UNKNOWN;
+			break;
+		}
+		if (d > worst) {
+			worst = d;
+			fn->worst = (int32_t)fn->callees[c];
+		}
+	}
+	if (fn->dynamic) {
+		fprintf(stderr, "%s: dynamic stack frame, no bound\n", fn->name);
+		unproven = 1;
+		worst = DEPTH_UNKNOWN;
+	}
+	if (fn->indirect && !fn->resolved) {
+		fprintf(stderr, "%s: indirect call not listed in the stack config\n", fn->name);
+		unproven = 1;
+		worst = DEPTH_UNKNOWN;
+	}
+	fn->depth = (worst == DEPTH_UNKNOWN) ? DEPTH_UNKNOWN : (fn->frame + worst);
+	fn->state = FUNC_DONE;
+	return fn->depth;
+}
+
+static void print_path(uint32_t i)
+{
+	printf("%s", funcs[i].name);
+	for (int32_t c = funcs[i].worst; c >= 0; c = funcs[c].worst) {
+		printf(" > %s", funcs[c].name);
+	}
+	if (funcs[i].extra > 0) {
+		printf(" (+%d external)", funcs[i].extra);
+	}
+	printf("\n");
+}
+
+static void print_root(const char *label, uint32_t i, int priority)
+{
+	char prio[16];
+	int32_t d = depth_of(i);
+
+	if (priority == PRIO_THREAD) {
+		snprintf(prio, sizeof(prio), "thread");
+	} else {
+		snprintf(prio, sizeof(prio), "%d", priority);
+	}
+	if (d == DEPTH_UNKNOWN) {
+		printf("%-26s %6s %8s  ", label, prio, "?");
+	} else {
+		printf("%-26s %6s %8d  ", label, prio, d);
+	}
+	print_path(i);
+}
+
+// SRAM ORIGIN and LENGTH from the generated memory script
+static int read_sram(const char *path, uint32_t *origin, uint32_t *length)
+{
+	FILE *f = fopen(path, "r");
+	char text[MAX_LINE];
+	int found = 0;
+
+	if (!f) {
+		return 0;
+	}
+	while (!found && fgets(text, sizeof(text), f)) {
+		char *o = strstr(text, "ORIGIN");
+		char *l = strstr(text, "LENGTH");
+
+		if ((strncmp(text + strspn(text, " \t"), "SRAM ", 5) == 0) && o && l) {
+			*origin = (uint32_t)strtoul(strchr(o, '=') + 1, 0, 0);
+			*length = (uint32_t)strtoul(strchr(l, '=') + 1, 0, 0);
+			found = 1;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t origin;
+	uint32_t length;
+	uint32_t stack_top;
+	uint32_t static_end;
+	int32_t total;
+	int32_t level_depth[VECTOR_COUNT];
+	int level_prio[VECTOR_COUNT];
+	int32_t level_root[VECTOR_COUNT];
+	uint32_t nlevels = 0;
+	int reset;
+	elf_section_t sec;
+
+	if ((argc > 1) && (strcmp(argv[1], "-v") == 0)) {
+		verbose = 1;
+		argv++;
+		argc--;
+	}
+	if (argc < 5) {
+		fprintf(stderr, "usage: axf_stack [-v] <image.axf> <memory.ld> <stack.txt> <file.su>...\n");
+		return EXIT_FAILURE;
+	}
+	if (!elf_load(argv[1])) {
+		fprintf(stderr, "%s: not an ARM ELF image\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (!read_sram(argv[2], &origin, &length)) {
+		fprintf(stderr, "%s: no SRAM region\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	mem = armv6m_mem_new();
+	elf_map(mem);
+	read_functions();
+	for (int a = 4; a < argc; a++) {
+		read_su(argv[a]);
+	}
+	for (uint32_t i = 0; i < nfuncs; i++) {
+		scan_function(&funcs[i]);
+	}
+	for (uint32_t v = 2; v < VECTOR_COUNT; v++) {	// Fixed priorities first
+		int h = func_at(armv6m_read(mem, VECTOR_TABLE + (v * 4), 4));
+
+		if ((h >= 0) && ((v == 2) || (v == 3))) {
+			funcs[h].priority = (v == 2) ? PRIO_NMI : PRIO_HARDFAULT;
+		}
+	}
+	if (!read_config(argv[3])) {
+		return EXIT_FAILURE;
+	}
+
+	// Static RAM ends where .heap2stackfill (room left to the stack) starts
+	stack_top = armv6m_read(mem, VECTOR_TABLE, 4);
+	static_end = origin;
+	for (uint32_t i = 0; elf_section(i, &sec); i++) {
+		if ((sec.flags & SHF_ALLOC) && (sec.size > 0) && (sec.addr >= origin) && (sec.addr < (origin + length))
+				&& (strcmp(sec.name, ".heap2stackfill") != 0) && (strcmp(sec.name, ".stack") != 0)
+				&& ((sec.addr + sec.size) > static_end)) {
+			static_end = sec.addr + sec.size;
+		}
+	}
+	printf("SRAM 0x%08x, %u bytes: static data to 0x%08x, stack from 0x%08x down: %u bytes\n\n",
+			origin, length, static_end, stack_top, stack_top - static_end);
+
+	printf("%-26s %6s %8s  %s\n", "root", "prio", "bytes", "worst path");
+	reset = func_at(armv6m_read(mem, VECTOR_TABLE + 4, 4));
+	if ((reset < 0) || (func_named("main") < 0)) {
+		fprintf(stderr, "no reset handler or main()\n");
+		return EXIT_FAILURE;
+	}
+	print_root(funcs[reset].name, (uint32_t)reset, PRIO_THREAD);
+	print_root("main", (uint32_t)func_named("main"), PRIO_THREAD);
+	total = depth_of((uint32_t)reset);
+
+	// Deepest handler per priority level, each one with its exception frame
+	for (uint32_t v = 2; v < VECTOR_COUNT; v++) {
+		int h = func_at(armv6m_read(mem, VECTOR_TABLE + (v * 4), 4));
+		uint32_t l;
+		int32_t d;
+
+		if ((h < 0) || (h == reset)) {
+			continue;
+		}
+		d = depth_of((uint32_t)h);
+		if (d != DEPTH_UNKNOWN) {
+			d += EXCEPTION_FRAME;
+		}
+		for (l = 0; (l < nlevels) && (level_prio[l] != funcs[h].priority); l++) {
+		}
+		if (l == nlevels) {
+			level_prio[nlevels] = funcs[h].priority;
+			level_depth[nlevels] = 0;
+			level_root[nlevels] = -1;
+			nlevels++;
+		}
+		if ((level_depth[l] != DEPTH_UNKNOWN) && ((d == DEPTH_UNKNOWN) || (d > level_depth[l]))) {
+			level_depth[l] = d;
+			level_root[l] = h;
+		}
+		if ((funcs[h].bind != STB_WEAK) && !funcs[h].printed) {
+			print_root(funcs[h].name, (uint32_t)h, funcs[h].priority);
+			funcs[h].printed = 1;
+		}
+	}
+
+	printf("\nworst case: thread %d", total);
+	for (int prio = PRIO_THREAD; prio >= PRIO_NMI; prio--) {	// Least urgent first
+		for (uint32_t l = 0; l < nlevels; l++) {
+			if (level_prio[l] != prio) {
+				continue;
+			}
+			if ((total == DEPTH_UNKNOWN) || (level_depth[l] == DEPTH_UNKNOWN)) {
+				total = DEPTH_UNKNOWN;
+				printf(" + prio %d %s ?", prio, funcs[level_root[l]].name);
+			} else {
+				total += level_depth[l];
+				printf(" + prio %d %s %d", prio, funcs[level_root[l]].name, level_depth[l]);
+			}
+		}
+	}
+
+	if (verbose) {
+		printf("\n\n%-32s %8s %6s %8s\n", "function", "frame", "from", "depth");
+		for (uint32_t i = 0; i < nfuncs; i++) {
+			printf("%-32s %8d %6s %8d\n", funcs[i].name, funcs[i].frame,
+					funcs[i].from_su ? ".su" : "code", depth_of(i));
+		}
+	}
+
+	if (unproven || (total == DEPTH_UNKNOWN)) {
+		printf("\n\nstack bound not proven, see above\n");
+		return EXIT_FAILURE;
+	}
+	printf(" = %d of %u bytes: %s\n", total, stack_top - static_end,
+			((uint32_t)total <= (stack_top - static_end)) ? "fits" : "OVERFLOW");
+	elf_free();
+	armv6m_mem_free(mem);
+	return ((uint32_t)total <= (stack_top - static_end)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
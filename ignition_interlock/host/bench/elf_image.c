@@ -0,0 +1,129 @@
+/**
+ * @file    elf_image.c
+ * @brief   Read-only view of a linked ARM ELF image (the .axf).
+ */
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "elf_image.h"
+
+static uint8_t *image;
+static long image_size;
+
+static const Elf32_Ehdr *header(void)
+{
+	return (const Elf32_Ehdr *)image;
+}
+
+static const Elf32_Shdr *shdr(uint32_t i)
+{
+	return (const Elf32_Shdr *)(image + header()->e_shoff + (i * header()->e_shentsize));
+}
+
+static const Elf32_Shdr *symtab(void)
+{
+	for (uint32_t i = 0; i < header()->e_shnum; i++) {
+		if (shdr(i)->sh_type == SHT_SYMTAB) {
+			return shdr(i);
+		}
+	}
+	return 0;
+}
+
+int elf_load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	image_size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	image = malloc((size_t)image_size);
+	if (fread(image, 1, (size_t)image_size, f) != (size_t)image_size) {
+		image_size = 0;
+	}
+	fclose(f);
+
+	return (image_size > (long)sizeof(Elf32_Ehdr)) && (memcmp(header()->e_ident, ELFMAG, SELFMAG) == 0)
+			&& (header()->e_ident[EI_CLASS] == ELFCLASS32) && (header()->e_machine == EM_ARM);
+}
+
+void elf_free(void)
+{
+	free(image);
+	image = 0;
+	image_size = 0;
+}
+
+int elf_symbol(uint32_t i, elf_symbol_t *sym)
+{
+	const Elf32_Shdr *sh = symtab();
+	const Elf32_Sym *s;
+
+	if (!sh || (i >= (sh->sh_size / sizeof(Elf32_Sym)))) {
+		return 0;
+	}
+	s = (const Elf32_Sym *)(image + sh->sh_offset) + i;
+	sym->name = (const char *)(image + shdr(sh->sh_link)->sh_offset + s->st_name);
+	sym->value = s->st_value;
+	sym->size = s->st_size;
+	sym->type = ELF32_ST_TYPE(s->st_info);
+	sym->bind = (s->st_shndx == SHN_UNDEF) ? STB_LOCAL : ELF32_ST_BIND(s->st_info);
+	if (s->st_shndx == SHN_UNDEF) {
+		sym->type = STT_NOTYPE;
+		sym->name = "";
+	}
+	return 1;
+}
+
+int elf_lookup(const char *name, uint32_t *value, int weak)
+{
+	elf_symbol_t sym;
+
+	for (uint32_t i = 0; elf_symbol(i, &sym); i++) {
+		if ((sym.name[0] == 0) || (!weak && (sym.bind == STB_WEAK))) {
+			continue;
+		}
+		if (strcmp(sym.name, name) == 0) {
+			*value = sym.value;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int elf_section(uint32_t i, elf_section_t *sec)
+{
+	const Elf32_Shdr *sh;
+
+	if (i >= header()->e_shnum) {
+		return 0;
+	}
+	sh = shdr(i);
+	sec->name = (const char *)(image + shdr(header()->e_shstrndx)->sh_offset + sh->sh_name);
+	sec->addr = sh->sh_addr;
+	sec->size = sh->sh_size;
+	sec->flags = sh->sh_flags;
+	sec->type = sh->sh_type;
+	return 1;
+}
+
+// .data starts initialised at its run address, as after ResetISR
+void elf_map(armv6m_mem_t *mem)
+{
+	for (uint32_t i = 0; i < header()->e_phnum; i++) {
+		const Elf32_Phdr *ph = (const Elf32_Phdr *)(image + header()->e_phoff + (i * header()->e_phentsize));
+
+		if (ph->p_type == PT_LOAD) {
+			armv6m_load(mem, ph->p_vaddr, image + ph->p_offset, ph->p_filesz);
+			if (ph->p_paddr != ph->p_vaddr) {
+				armv6m_load(mem, ph->p_paddr, image + ph->p_offset, ph->p_filesz);
+			}
+		}
+	}
+}
@@ -0,0 +1,42 @@
+/**
+ * @file    elf_image.h
+ * @brief   Read-only view of a linked ARM ELF image (the .axf).
+ */
+
+#ifndef ELF_IMAGE_H_
+#define ELF_IMAGE_H_
+
+#include <stdint.h>
+
+#include "armv6m.h"
+
+typedef struct {
+	const char *name;
+	uint32_t value;	// Thumb bit set for functions
+	uint32_t size;
+	uint8_t type;	// STT_*
+	uint8_t bind;	// STB_*
+} elf_symbol_t;
+
+typedef struct {
+	const char *name;
+	uint32_t addr;
+	uint32_t size;
+	uint32_t flags;	// SHF_*
+	uint32_t type;	// SHT_*
+} elf_section_t;
+
+int elf_load(const char *path);
+void elf_free(void);
+
+// Defined symbol by name; weak ones (the startup default handlers) only if allowed
+int elf_lookup(const char *name, uint32_t *value, int weak);
+
+// Iterate with i = 0, 1, ... until these return 0
+int elf_symbol(uint32_t i, elf_symbol_t *sym);
+int elf_section(uint32_t i, elf_section_t *sec);
+
+// Copies the loadable segments to their run and load addresses
+void elf_map(armv6m_mem_t *mem);
+
+#endif /* ELF_IMAGE_H_ */
@@ -0,0 +1,630 @@
+/**
+ * @file    map_size.c
+ * @brief   Flash and RAM per region, section, object and symbol from the linker map.
+ *
+ * Usage: map_size [-n <rows>] [-b <budgets.txt>] [<old.map>] <new.map>
+ *
+ * Reads the "Memory Configuration" and "Linker script and memory map" parts
+ * of a GNU ld map (-Wl,-Map). Every input section is charged to the object
+ * that brought it in; the symbols ld lists inside it split it further, each
+ * up to the next symbol. Fill and linker-generated words (the section table)
+ * are charged to "*fill*" and "*linker*". Bytes in a writable region count
+ * as RAM, the rest as flash; .data counts as both, at its run and load
+ * addresses. With two maps only what changed is listed, largest change first.
+ *
+ * budgets.txt, one per line:
+ *   <region|section|object|symbol> <name|*> <max|growth> <bytes>
+ * "max" caps the size in the new map, "growth" the increase over the old one.
+ * A named line overrides the "*" line of the same kind. Any item over budget
+ * fails the run.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_REGIONS (16)
+#define MAX_SYMS (64) // Symbols listed inside one input section
+#define MAX_BUDGETS (64)
+#define MAX_TOKENS (8)
+#define MAX_LINE (1024)
+#define DEFAULT_ROWS (20)
+
+enum {
+	KIND_REGION = 0,
+	KIND_SECTION,
+	KIND_OBJECT,
+	KIND_SYMBOL,
+	KIND_COUNT,
+};
+
+enum {
+	BUDGET_MAX = 0,
+	BUDGET_GROWTH,
+};
+
+static const char *const kind_names[KIND_COUNT] = {"region", "section", "object", "symbol"};
+
+typedef struct {
+	char *name;
+	uint32_t origin;
+	uint32_t length;
+	int writable;
+} region_t;
+
+// One contiguous piece of an output section
+typedef struct {
+	char *symbol;
+	char *object;
+	char *section;
+	uint32_t size;
+	int vma_region;
+	int lma_region;	// -1 unless loaded somewhere else (.data)
+} piece_t;
+
+typedef struct {
+	region_t region[MAX_REGIONS];
+	int nregions;
+	piece_t *piece;
+	int npieces;
+	int cap;
+} map_t;
+
+// Totals of one region, section, object or symbol
+typedef struct {
+	const char *name;
+	const char *object;	// symbols only: the same static name can be in two objects
+	long flash;
+	long ram;
+	long old_flash;
+	long old_ram;
+	int in_new;
+	int in_old;
+} item_t;
+
+typedef struct {
+	int kind;
+	char name[128];
+	int type;
+	long bytes;
+} budget_t;
+
+// Output section being read
+typedef struct {
+	char name[128];
+	int vma_region;
+	int lma_region;
+	int alloc;
+} out_section_t;
+
+// Input section being read, with the symbols listed inside it
+typedef struct {
+	char name[128];
+	char object[256];
+	uint32_t addr;
+	uint32_t size;
+	int open;
+	int nsyms;
+	char *sym[MAX_SYMS];
+	uint32_t sym_addr[MAX_SYMS];
+} in_section_t;
+
+static char *dup(const char *s)
+{
+	char *d = malloc(strlen(s) + 1);
+
+	strcpy(d, s);
+	return d;
+}
+
+static int split(char *text, char **tok)
+{
+	int n = 0;
+
+	for (char *t = strtok(text, " \t\r\n"); t && (n < MAX_TOKENS); t = strtok(0, " \t\r\n")) {
+		tok[n++] = t;
+	}
+	return n;
+}
+
+static int is_hex(const char *s)
+{
+	return (s[0] == '0') && (s[1] == 'x');
+}
+
+static int find_region(const map_t *map, uint32_t addr)
+{
+	for (int i = 0; i < map->nregions; i++) {
+		if ((addr >= map->region[i].origin) && (addr - map->region[i].origin < map->region[i].length)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Debug and note sections take no space on the target
+static int is_alloc(const char *name)
+{
+	return (strncmp(name, ".debug", 6) != 0) && (strncmp(name, ".stab", 5) != 0)
+			&& (strcmp(name, ".comment") != 0) && (strcmp(name, ".ARM.attributes") != 0);
+}
+
+// "./source/x.o" -> "x.o", "c:/...\libc.a(y.o)" -> "libc.a(y.o)"
+static const char *object_name(const char *path)
+{
+	const char *base = path;
+
+	for (const char *p = path; *p; p++) {
+		if ((*p == '/') || (*p == '\\')) {
+			base = p + 1;
+		}
+	}
+	return base;
+}
+
+static void add_piece(map_t *map, const out_section_t *out, const char *symbol, const char *object, uint32_t size)
+{
+	piece_t *p;
+
+	if ((size == 0) || !out->alloc) {
+		return;
+	}
+	if (map->npieces == map->cap) {
+		map->cap = map->cap ? (map->cap * 2) : 256;
+		map->piece = realloc(map->piece, (size_t)map->cap * sizeof(piece_t));
+	}
+	p = &map->piece[map->npieces++];
+	p->symbol = dup(symbol);
+	p->object = dup(object_name(object));
+	p->section = dup(out->name);
+	p->size = size;
+	p->vma_region = out->vma_region;
+	p->lma_region = out->lma_region;
+}
+
+// Each symbol runs to the next one at a higher address; aliases count once
+static void close_input(map_t *map, const out_section_t *out, in_section_t *in)
+{
+	uint32_t end = in->addr + in->size;
+	uint32_t covered = in->addr;
+	int first = 1;
+
+	if (!in->open) {
+		return;
+	}
+	for (int i = 0; i < in->nsyms; i++) {
+		uint32_t next = end;
+
+		if ((in->sym_addr[i] < in->addr) || (in->sym_addr[i] >= end)
+				|| ((i > 0) && (in->sym_addr[i] == in->sym_addr[i - 1]))) {
+			continue;
+		}
+		for (int j = i + 1; j < in->nsyms; j++) {
+			if ((in->sym_addr[j] > in->sym_addr[i]) && (in->sym_addr[j] < next)) {
+				next = in->sym_addr[j];
+			}
+		}
+		// Anything ahead of the first symbol is its own
+		add_piece(map, out, in->sym[i], in->object, next - (first ? in->addr : in->sym_addr[i]));
+		covered = next;
+		first = 0;
+	}
+	if (first) {
+		add_piece(map, out, in->name, in->object, in->size);
+	} else if (covered < end) {
+		add_piece(map, out, in->name, in->object, end - covered);
+	}
+	for (int i = 0; i < in->nsyms; i++) {
+		free(in->sym[i]);
+	}
+	in->nsyms = 0;
+	in->open = 0;
+}
+
+// "<addr> <size> [load address <lma>]" of an output section
+static void open_output(map_t *map, out_section_t *out, char **tok, int ntok)
+{
+	uint32_t addr = (uint32_t)strtoul(tok[0], 0, 0);
+
+	out->alloc = is_alloc(out->name);
+	out->vma_region = find_region(map, addr);
+	out->lma_region = -1;
+	if ((ntok >= 5) && (strcmp(tok[2], "load") == 0)) {
+		int lma = find_region(map, (uint32_t)strtoul(tok[4], 0, 0));
+
+		out->lma_region = (lma != out->vma_region) ? lma : -1;
+	}
+}
+
+// "<addr> <size> <object>" of an input section
+static void open_input(in_section_t *in, char **tok, int ntok)
+{
+	in->addr = (uint32_t)strtoul(tok[0], 0, 0);
+	in->size = (uint32_t)strtoul(tok[1], 0, 0);
+	snprintf(in->object, sizeof(in->object), "%s", (ntok >= 3) ? tok[2] : "*linker*");
+	in->nsyms = 0;
+	in->open = 1;
+}
+
+static int read_map(const char *path, map_t *map)
+{
+	static out_section_t out;
+	static in_section_t in;
+	FILE *f = fopen(path, "r");
+	char text[MAX_LINE];
+	enum { SKIP, MEMORY, LAYOUT, OUT_WRAPPED, IN_WRAPPED } state = SKIP;
+
+	if (!f) {
+		return 0;
+	}
+	memset(map, 0, sizeof(*map));
+	out.alloc = 0;
+	in.open = 0;
+	while (fgets(text, sizeof(text), f)) {
+		char line[MAX_LINE];
+		char *tok[MAX_TOKENS];
+		int ntok;
+
+		strcpy(line, text);
+		ntok = split(line, tok);
+		if (strncmp(text, "Memory Configuration", 20) == 0) {
+			state = MEMORY;
+			continue;
+		}
+		if (strncmp(text, "Linker script and memory map", 28) == 0) {
+			state = LAYOUT;
+			continue;
+		}
+		if (strncmp(text, "Cross Reference Table", 21) == 0) {
+			break;
+		}
+		if (state == MEMORY) {
+			if ((ntok >= 3) && is_hex(tok[1]) && (tok[0][0] != '*') && (map->nregions < MAX_REGIONS)) {
+				region_t *r = &map->region[map->nregions++];
+
+				r->name = dup(tok[0]);
+				r->origin = (uint32_t)strtoul(tok[1], 0, 0);
+				r->length = (uint32_t)strtoul(tok[2], 0, 0);
+				r->writable = (ntok >= 4) && (strchr(tok[3], 'w') != 0);
+			}
+			continue;
+		}
+		if ((state == SKIP) || (ntok == 0)) {
+			continue;
+		}
+		if (state == OUT_WRAPPED) {
+			state = LAYOUT;
+			if ((ntok >= 2) && is_hex(tok[0])) {
+				open_output(map, &out, tok, ntok);
+				continue;
+			}
+		}
+		if (state == IN_WRAPPED) {
+			state = LAYOUT;
+			if ((ntok >= 2) && is_hex(tok[0]) && is_hex(tok[1])) {
+				open_input(&in, tok, ntok);
+				continue;
+			}
+		}
+		if (text[0] == '.') {
+			close_input(map, &out, &in);
+			snprintf(out.name, sizeof(out.name), "%s", tok[0]);
+			if (ntok == 1) {
+				state = OUT_WRAPPED;
+			} else {
+				open_output(map, &out, tok + 1, ntok - 1);
+			}
+		} else if ((text[0] == ' ') && ((text[1] == '.') || (strncmp(text + 1, "COMMON", 6) == 0))) {
+			close_input(map, &out, &in);
+			snprintf(in.name, sizeof(in.name), "%s", tok[0]);
+			if (ntok == 1) {
+				state = IN_WRAPPED;
+			} else {
+				open_input(&in, tok + 1, ntok - 1);
+			}
+		} else if ((strncmp(text, " *fill*", 7) == 0) && (ntok >= 3)) {
+			char fill[160];
+
+			close_input(map, &out, &in);
+			snprintf(fill, sizeof(fill), "*fill* %s", out.name);	// .heap and the stack are fill too
+			add_piece(map, &out, fill, "*fill*", (uint32_t)strtoul(tok[2], 0, 0));
+		} else if ((ntok >= 3) && is_hex(tok[0]) && is_hex(tok[1])
+				&& ((strcmp(tok[2], "LONG") == 0) || (strcmp(tok[2], "SHORT") == 0) || (strcmp(tok[2], "BYTE") == 0))) {
+			close_input(map, &out, &in);
+			add_piece(map, &out, "*linker*", "*linker*", (uint32_t)strtoul(tok[1], 0, 0));
+		} else if ((ntok == 2) && is_hex(tok[0]) && !is_hex(tok[1]) && in.open && (in.nsyms < MAX_SYMS)) {
+			in.sym[in.nsyms] = dup(tok[1]);
+			in.sym_addr[in.nsyms++] = (uint32_t)strtoul(tok[0], 0, 0);
+		}
+	}
+	close_input(map, &out, &in);
+	fclose(f);
+	return map->nregions > 0;
+}
+
+static const char *piece_key(const piece_t *p, int kind)
+{
+	return (kind == KIND_SECTION) ? p->section : (kind == KIND_OBJECT) ? p->object : p->symbol;
+}
+
+static item_t *find_item(item_t **items, int *n, int *cap, const char *name, const char *object)
+{
+	for (int i = 0; i < *n; i++) {
+		if ((strcmp((*items)[i].name, name) == 0)
+				&& (!object || (strcmp((*items)[i].object, object) == 0))) {
+			return &(*items)[i];
+		}
+	}
+	if (*n == *cap) {
+		*cap = *cap ? (*cap * 2) : 64;
+		*items = realloc(*items, (size_t)*cap * sizeof(item_t));
+	}
+	memset(&(*items)[*n], 0, sizeof(item_t));
+	(*items)[*n].name = name;
+	(*items)[*n].object = object;
+	return &(*items)[(*n)++];
+}
+
+static void charge(const map_t *map, int region, uint32_t size, long *flash, long *ram)
+{
+	if (region < 0) {
+		return;
+	}
+	if (map->region[region].writable) {
+		*ram += size;
+	} else {
+		*flash += size;
+	}
+}
+
+// Adds the totals of one map into items; old selects which columns
+static void tally(const map_t *map, int kind, int old, item_t **items, int *n, int *cap)
+{
+	if (kind == KIND_REGION) {
+		for (int i = 0; i < map->nregions; i++) {
+			item_t *it = find_item(items, n, cap, map->region[i].name, 0);
+
+			it->in_old |= old;
+			it->in_new |= !old;
+		}
+	}
+	for (int i = 0; i < map->npieces; i++) {
+		const piece_t *p = &map->piece[i];
+		int regions[2] = {p->vma_region, p->lma_region};
+
+		for (int r = 0; r < 2; r++) {
+			item_t *it;
+			long flash = 0;
+			long ram = 0;
+
+			if (regions[r] < 0) {
+				continue;
+			}
+			charge(map, regions[r], p->size, &flash, &ram);
+			if (kind == KIND_REGION) {
+				it = find_item(items, n, cap, map->region[regions[r]].name, 0);
+			} else {
+				it = find_item(items, n, cap, piece_key(p, kind), (kind == KIND_SYMBOL) ? p->object : 0);
+			}
+			if (old) {
+				it->old_flash += flash;
+				it->old_ram += ram;
+				it->in_old = 1;
+			} else {
+				it->flash += flash;
+				it->ram += ram;
+				it->in_new = 1;
+			}
+		}
+	}
+}
+
+static long delta(const item_t *it)
+{
+	return (it->flash + it->ram) - (it->old_flash + it->old_ram);
+}
+
+static int by_size(const void *a, const void *b)
+{
+	long sa = ((const item_t *)a)->flash + ((const item_t *)a)->ram;
+	long sb = ((const item_t *)b)->flash + ((const item_t *)b)->ram;
+
+	return (sa < sb) - (sa > sb);
+}
+
+static int by_delta(const void *a, const void *b)
+{
+	long da = labs(delta(a));
+	long db = labs(delta(b));
+
+	return (da < db) - (da > db);
+}
+
+static const budget_t *find_budget(const budget_t *budget, int nbudgets, int kind, const char *name, int type)
+{
+	const budget_t *any = 0;
+
+	for (int i = 0; i < nbudgets; i++) {
+		if ((budget[i].kind != kind) || (budget[i].type != type)) {
+			continue;
+		}
+		if (strcmp(budget[i].name, name) == 0) {
+			return &budget[i];
+		}
+		if (strcmp(budget[i].name, "*") == 0) {
+			any = &budget[i];
+		}
+	}
+	return any;
+}
+
+static int read_budgets(const char *path, budget_t *budget)
+{
+	FILE *f = fopen(path, "r");
+	char text[MAX_LINE];
+	int n = 0;
+	int line = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(text, sizeof(text), f)) {
+		char *tok[MAX_TOKENS];
+		char *hash = strchr(text, '#');
+		int ntok;
+		int kind;
+
+		line++;
+		if (hash) {
+			*hash = 0;
+		}
+		ntok = split(text, tok);
+		if (ntok == 0) {
+			continue;
+		}
+		for (kind = 0; (kind < KIND_COUNT) && (ntok == 4) && (strcmp(tok[0], kind_names[kind]) != 0); kind++) {
+		}
+		if ((ntok != 4) || (kind == KIND_COUNT) || (n == MAX_BUDGETS)
+				|| ((strcmp(tok[2], "max") != 0) && (strcmp(tok[2], "growth") != 0))) {
+			fprintf(stderr, "%s:%d: expected <region|section|object|symbol> <name|*> <max|growth> <bytes>\n",
+					path, line);
+			fclose(f);
+			return -1;
+		}
+		budget[n].kind = kind;
+		snprintf(budget[n].name, sizeof(budget[n].name), "%s", tok[1]);
+		budget[n].type = (strcmp(tok[2], "max") == 0) ? BUDGET_MAX : BUDGET_GROWTH;
+		budget[n].bytes = strtol(tok[3], 0, 0);
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static void print_name(const item_t *it, int kind)
+{
+	char name[160];
+
+	if ((kind == KIND_SYMBOL) && (it->object[0] != '*')) {
+		snprintf(name, sizeof(name), "%s  %s", it->name, it->object);
+	} else {
+		snprintf(name, sizeof(name), "%s", it->name);
+	}
+	printf("%-52s", name);
+}
+
+// Prints one table and returns the number of items over budget
+static int report(const map_t *old, const map_t *cur, int kind, int rows, const budget_t *budget, int nbudgets)
+{
+	item_t *items = 0;
+	int n = 0;
+	int cap = 0;
+	int over = 0;
+	int shown = 0;
+
+	if (old) {
+		tally(old, kind, 1, &items, &n, &cap);
+	}
+	tally(cur, kind, 0, &items, &n, &cap);
+	qsort(items, (size_t)n, sizeof(item_t), old ? by_delta : by_size);
+
+	printf("\n%-52s %8s %8s", kind_names[kind], "flash", "ram");
+	if (old) {
+		printf(" %8s %8s %8s", "old", "new", "delta");
+	} else if (kind == KIND_REGION) {
+		printf(" %8s %6s", "length", "used");
+	}
+	printf("\n");
+	for (int i = 0; i < n; i++) {
+		const item_t *it = &items[i];
+		long size = it->flash + it->ram;
+		const budget_t *max = find_budget(budget, nbudgets, kind, it->name, BUDGET_MAX);
+		const budget_t *growth = old ? find_budget(budget, nbudgets, kind, it->name, BUDGET_GROWTH) : 0;
+		int bad_max = max && (size > max->bytes);
+		int bad_growth = growth && (delta(it) > growth->bytes);
+		int listed = (kind == KIND_REGION) || (old ? (delta(it) != 0) : (size != 0));
+
+		over += bad_max + bad_growth;
+		if (!(listed && ((kind == KIND_REGION) || (shown < rows))) && !bad_max && !bad_growth) {
+			continue;
+		}
+		shown++;
+		print_name(it, kind);
+		printf(" %8ld %8ld", it->flash, it->ram);
+		if (old) {
+			printf(" %8ld %8ld %+8ld", it->old_flash + it->old_ram, size, delta(it));
+		} else if (kind == KIND_REGION) {
+			for (int r = 0; r < cur->nregions; r++) {
+				if (strcmp(cur->region[r].name, it->name) == 0) {
+					printf(" %8u %5.1f%%", cur->region[r].length,
+							cur->region[r].length ? (100.0 * (double)size / cur->region[r].length) : 0.0);
+				}
+			}
+		}
+		if (old && !it->in_old) {
+			printf("  added");
+		} else if (old && !it->in_new) {
+			printf("  removed");
+		}
+		if (bad_max) {
+			printf("  OVER max %ld", max->bytes);
+		}
+		if (bad_growth) {
+			printf("  OVER growth %ld", growth->bytes);
+		}
+		printf("\n");
+	}
+	free(items);
+	return over;
+}
+
+int main(int argc, char **argv)
+{
+	static budget_t budget[MAX_BUDGETS];
+	static map_t maps[2];
+	int nbudgets = 0;
+	int rows = DEFAULT_ROWS;
+	int over = 0;
+	int opt = 1;
+
+	for (; (opt + 1 < argc) && (argv[opt][0] == '-'); opt += 2) {
+		if (strcmp(argv[opt], "-n") == 0) {
+			rows = atoi(argv[opt + 1]);
+		} else if (strcmp(argv[opt], "-b") == 0) {
+			nbudgets = read_budgets(argv[opt + 1], budget);
+			if (nbudgets < 0) {
+				return EXIT_FAILURE;
+			}
+		} else {
+			break;
+		}
+	}
+	if ((argc - opt < 1) || (argc - opt > 2)) {
+		fprintf(stderr, "usage: map_size [-n <rows>] [-b <budgets.txt>] [<old.map>] <new.map>\n");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < argc - opt; i++) {
+		if (!read_map(argv[opt + i], &maps[i])) {
+			fprintf(stderr, "%s: not a linker map with a memory configuration\n", argv[opt + i]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - opt == 2) {
+		printf("%s -> %s\n", argv[opt], argv[opt + 1]);
+	} else {
+		printf("%s\n", argv[opt]);
+	}
+	for (int kind = 0; kind < KIND_COUNT; kind++) {
+		if (argc - opt == 2) {
+			over += report(&maps[0], &maps[1], kind, rows, budget, nbudgets);
+		} else {
+			over += report(0, &maps[0], kind, rows, budget, nbudgets);
+		}
+	}
+	if (over) {
+		printf("\n%d item(s) over budget\n", over);
+	}
+	return over ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,415 @@
+/**
+ * @file    breath_replay.c
+ * @brief   Time to the BAC decision over a set of breath traces, replayed through the firmware.
+ *
+ * Usage: breath_replay [trace ...]
+ *
+ * Each trace runs one session of the firmware in the simulator, in a child
+ * process of its own: the button at PRESS_AT_MS, then the trace as the
+ * sensor until the result is on the panel. A trace file holds one sample
+ * per line in 12-bit ADC counts at ADC_SAMPLE_RATE_HZ, starting at the
+ * press; '#' starts a comment. Without files, synthetic breaths with a
+ * fixed seed and random settled level, time constants, start, length and
+ * conversion noise, from three sensor models:
+ * - REPLAY_TRACES with a first-order rise and decay, the time constant
+ *   within SENSOR_TAU_MIN_MS to SENSOR_TAU_MAX_MS, the range
+ *   BAC_Estimate() is built for
+ * - REPLAY_OFF_MODEL_TRACES first-order, the time constant outside it
+ * - REPLAY_OFF_MODEL_TRACES second-order: a second lag after the first,
+ *   which BAC_Estimate() does not model
+ *
+ * Prints the time from the press to the result per way the firmware got
+ * there (BAC_Estimate() early, the end of the plateau, the fallback timer,
+ * or no breath read) and a histogram of all of them. For synthetic breaths
+ * it also counts results on the other side of BAC_LIMIT from the level the
+ * breath reached, and fails if any is more than WRONG_SIDE_MARGIN from it.
+ * "No breath" is neither side: it never starts the car. On a trace that
+ * rose more than CLEAR_BREATH_COUNTS it is a miss instead: the driver has
+ * to blow again. The wrong-side results and the misses are also counted
+ * per sensor model.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The firmware is built into this file for its settings and its state
+#define main interlock_main
+#include "ignition_interlock.c"
+#undef main
+#include "lpc802_sim.h"
+
+#define REPLAY_TRACES (500)
+#define REPLAY_OFF_MODEL_TRACES (250) // Per sensor model BAC_Estimate() is not built for
+#define MAX_TRACE_SAMPLES (3000) // 30 s at ADC_SAMPLE_RATE_HZ
+#define PRESS_AT_MS (1000)
+#define POLL_MS (10)
+#define DEADLINE_MS (PRESS_AT_MS + BAC_RESULT_DELAY_MS + 500)
+#define BIN_MS (500) // Histogram bins
+#define BINS (((BAC_RESULT_DELAY_MS + 500) / BIN_MS) + 1)
+// BAC units (0.00001 %) either side of BAC_LIMIT where a result may fall on
+// the wrong side: 0.005 %, half the last digit setLCDBACMsg() shows. It is
+// 12 conversion counts, the largest noise (one sigma) of the synthetic
+// traces. Closer to the limit than that, a breath cannot be told apart.
+#define WRONG_SIDE_MARGIN (500)
+// Rise over idle, in conversion counts, that no detector should take for
+// no breath: over twice BREATH_THRESHOLD_MARGIN and ten times the noise
+#define CLEAR_BREATH_COUNTS (150)
+
+#define PATH_NONE (0) // No result by DEADLINE_MS
+#define PATH_EARLY (1) // BAC_Estimate() decided
+#define PATH_PLATEAU (2) // BREATH_Update() saw the plateau end
+#define PATH_TIMER (3) // BAC_RESULT_DELAY_MS fallback
+#define PATH_NO_BREATH (4) // ... with no plateau to read: BAC_NO_BREATH
+#define PATHS (5)
+
+#define MODEL_FIRST_ORDER (0) // Time constant within SENSOR_TAU_MIN_MS to SENSOR_TAU_MAX_MS
+#define MODEL_OUT_OF_RANGE (1) // First order, up to 3x faster or slower than that range
+#define MODEL_SECOND_ORDER (2) // Two lags in series
+#define MODELS (3)
+
+typedef struct {
+	// Synthetic breath, in ADC counts and ms after the press
+	double idle;
+	double level;	// where the sensor settles if blown long enough
+	int model;
+	double rise_ms;
+	double lag_ms;	// second lag, MODEL_SECOND_ORDER only
+	double decay_ms;
+	double start_ms;
+	double blow_ms;
+	double noise;	// standard deviation per conversion
+	// Or a recorded one
+	uint16_t *samples;
+	int count;
+} trace_t;
+
+typedef struct {
+	int path;
+	int bac;
+	double seconds;	// press to result
+} result_t;
+
+static const trace_t *replaying;
+static result_t *reporting;	// shared with the parent
+static uint32_t noise_state;
+
+static double gaussian(uint32_t *state)
+{
+	// Sum of four uniforms: close enough, and no libc state shared with rand()
+	double sum = 0.0;
+
+	for (int i = 0; i < 4; i++) {
+		*state = (*state * 1103515245U) + 12345U;
+		sum += (double)(*state >> 8) / (double)(1U << 24);
+	}
+	return (sum - 2.0) * sqrt(3.0);
+}
+
+static double lags(const trace_t *tr, double t_ms)
+{
+	// Step response of rise_ms and lag_ms in series, 0 before the step
+	if (t_ms <= 0.0) {
+		return 0.0;
+	}
+	return 1.0 - (((tr->rise_ms * exp(-t_ms / tr->rise_ms)) - (tr->lag_ms * exp(-t_ms / tr->lag_ms)))
+			/ (tr->rise_ms - tr->lag_ms));
+}
+
+static double breath(const trace_t *tr, double t_ms)
+{
+	// Sensor response to a blow of blow_ms: first-order with its own decay,
+	// or the second-order lags both ways
+	double reached;
+
+	if (t_ms < tr->start_ms) {
+		return tr->idle;
+	}
+	if (tr->model == MODEL_SECOND_ORDER) {
+		return tr->idle + ((tr->level - tr->idle)
+				* (lags(tr, t_ms - tr->start_ms) - lags(tr, t_ms - tr->start_ms - tr->blow_ms)));
+	}
+	if (t_ms < (tr->start_ms + tr->blow_ms)) {
+		return tr->idle + ((tr->level - tr->idle) * (1.0 - exp(-(t_ms - tr->start_ms) / tr->rise_ms)));
+	}
+	reached = 1.0 - exp(-tr->blow_ms / tr->rise_ms);
+	return tr->idle + ((tr->level - tr->idle) * reached
+			* exp(-(t_ms - tr->start_ms - tr->blow_ms) / tr->decay_ms));
+}
+
+static double peak(const trace_t *tr)
+{
+	// What the breath reached: the level only if the blow was long enough.
+	// A second lag goes on rising after the blow.
+	double highest = breath(tr, tr->start_ms + tr->blow_ms);
+
+	for (double t = tr->start_ms; t < (tr->start_ms + tr->blow_ms + (4.0 * tr->lag_ms) + 1.0); t += 1.0) {
+		double x = breath(tr, t);
+
+		highest = (x > highest) ? x : highest;
+	}
+	return highest;
+}
+
+static uint16_t sensor(uint64_t t_us)
+{
+	const trace_t *tr = replaying;
+	double t_ms = (t_us / 1000.0) - PRESS_AT_MS;
+	double x;
+
+	if (tr->samples) {
+		int n = (t_ms < 0) ? 0 : (int)(t_ms * ADC_SAMPLE_RATE_HZ / 1000.0);
+
+		return tr->samples[(n < tr->count) ? n : (tr->count - 1)];
+	}
+	x = breath(tr, t_ms) + (tr->noise * gaussian(&noise_state));
+	return (uint16_t)((x < 0) ? 0 : (x > ADC_MAX) ? ADC_MAX : lround(x));
+}
+
+static void press_button(void)
+{
+	sim_press_button();
+}
+
+static void poll(void)
+{
+	if (bac_checked) {
+		reporting->path = (bac == BAC_NO_BREATH) ? PATH_NO_BREATH
+				: (bac_est_level != 0) ? PATH_EARLY
+				: (breath_state == BREATH_DONE) ? PATH_PLATEAU : PATH_TIMER;
+		reporting->bac = bac;
+		reporting->seconds = ((double)sim_now_us() / 1e6) - (PRESS_AT_MS / 1000.0);
+		_exit(EXIT_SUCCESS);
+	}
+	sim_at(sim_now_us() + (POLL_MS * 1000U), poll);
+}
+
+static void replay(const trace_t *tr, uint32_t seed, result_t *out)
+{
+	// A fresh copy of the firmware's globals per trace
+	pid_t pid;
+	int status;
+
+	out->path = PATH_NONE;
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		replaying = tr;
+		reporting = out;
+		noise_state = seed;
+		sim_init();
+		sim_adc_set_source(sensor);
+		sim_at(PRESS_AT_MS * 1000U, press_button);
+		sim_at((PRESS_AT_MS + POLL_MS) * 1000U, poll);
+		sim_run(interlock_main, DEADLINE_MS * 1000U);
+		_exit(EXIT_SUCCESS);
+	}
+	waitpid(pid, &status, 0);
+}
+
+static int load(const char *path, trace_t *tr)
+{
+	FILE *f = fopen(path, "r");
+	char line[128];
+
+	if (!f) {
+		perror(path);
+		return 0;
+	}
+	memset(tr, 0, sizeof(*tr));
+	tr->samples = malloc(MAX_TRACE_SAMPLES * sizeof(uint16_t));
+	while (fgets(line, sizeof(line), f) && (tr->count < MAX_TRACE_SAMPLES)) {
+		char *hash = strchr(line, '#');
+		char *end;
+		long v;
+
+		if (hash) {
+			*hash = 0;
+		}
+		v = strtol(line, &end, 0);
+		if (end != line) {
+			tr->samples[tr->count++] = (uint16_t)((v < 0) ? 0 : (v > ADC_MAX) ? ADC_MAX : v);
+		}
+	}
+	fclose(f);
+	if (tr->count == 0) {
+		fprintf(stderr, "%s: no samples\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+static double uniform(double low, double high)
+{
+	return low + ((high - low) * rand() / (double)RAND_MAX);
+}
+
+static void synthesize(trace_t *tr, int model)
+{
+	// Around BAC_LIMIT and over the firmware's range of sensor time
+	// constants, so the estimator meets borderline breaths and sensors
+	// slower and faster than SENSOR_TAU_MS; then sensors outside the range
+	// or of higher order, which it is not built for
+	memset(tr, 0, sizeof(*tr));
+	tr->model = model;
+	tr->idle = uniform(1960.0, 2040.0);
+	tr->level = uniform(2000.0, 2700.0);
+	tr->rise_ms = uniform(SENSOR_TAU_MIN_MS, SENSOR_TAU_MAX_MS);
+	if (model == MODEL_OUT_OF_RANGE) {
+		tr->rise_ms = (rand() & 1) ? uniform(SENSOR_TAU_MIN_MS / 3.0, SENSOR_TAU_MIN_MS)
+				: uniform(SENSOR_TAU_MAX_MS, SENSOR_TAU_MAX_MS * 3.0);
+	} else if (model == MODEL_SECOND_ORDER) {
+		tr->lag_ms = tr->rise_ms * uniform(0.2, 0.8);
+	}
+	tr->decay_ms = uniform(500.0, 1500.0);
+	tr->start_ms = uniform(1000.0, 3000.0);
+	tr->blow_ms = uniform(1000.0, 5000.0);
+	tr->noise = uniform(0.0, 12.0);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void print_path(const char *name, double *t, int count, int wrong, int synthetic)
+{
+	printf("%-14s %7d", name, count);
+	if (count == 0) {
+		printf("%8s %7s %7s %7s", "-", "-", "-", "-");
+	} else {
+		qsort(t, count, sizeof(double), compare_double);
+		printf("%8.2f %7.2f %7.2f %7.2f", t[count / 10], t[count / 2], t[(count * 9) / 10], t[count - 1]);
+	}
+	if (synthetic) {
+		printf(" %11d\n", wrong);
+	} else {
+		printf(" %11s\n", "-");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const names[PATHS] = {"no result", "early", "plateau end", "timer", "no breath"};
+	static const char *const models[MODELS] = {"first order, tau in range", "first order, tau out of range",
+			"second order"};
+	int synthetic = (argc < 2);
+	int count = synthetic ? (REPLAY_TRACES + ((MODELS - 1) * REPLAY_OFF_MODEL_TRACES)) : (argc - 1);
+	trace_t *traces = calloc(count, sizeof(trace_t));
+	result_t *results = mmap(NULL, count * sizeof(result_t), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	double *times = calloc(count, sizeof(double));
+	double *all = calloc(count, sizeof(double));
+	int wrong[PATHS] = {0};
+	int beyond = 0;	// wrong side by more than WRONG_SIDE_MARGIN
+	int wrong_all = 0;
+	int wrong_model[MODELS] = {0};
+	int beyond_model[MODELS] = {0};
+	int missed = 0;	// clear breaths read as no breath
+	int missed_model[MODELS] = {0};
+	int bins[BINS] = {0};
+	int decided = 0;
+	int widest = 1;
+
+	if (!traces || (results == MAP_FAILED) || !times || !all) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	srand(1);
+	for (int i = 0; i < count; i++) {
+		if (synthetic) {
+			synthesize(&traces[i], (i < REPLAY_TRACES) ? MODEL_FIRST_ORDER
+					: (MODEL_FIRST_ORDER + 1 + ((i - REPLAY_TRACES) / REPLAY_OFF_MODEL_TRACES)));
+		} else if (!load(argv[i + 1], &traces[i])) {
+			return EXIT_FAILURE;
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		replay(&traces[i], (uint32_t)i + 1U, &results[i]);
+		if (synthetic && (results[i].path != PATH_NONE) && (results[i].path != PATH_NO_BREATH)) {
+			uint32_t reached = (uint32_t)lround(peak(&traces[i]) * (1 << ADC_OVERSAMPLE_BITS));
+			int level = BAC_FromAdc(reached);
+
+			if ((results[i].bac > BAC_LIMIT) != (level > BAC_LIMIT)) {
+				int far = (abs(level - BAC_LIMIT) > WRONG_SIDE_MARGIN);
+
+				wrong[results[i].path]++;
+				wrong_all++;
+				wrong_model[traces[i].model]++;
+				beyond += far;
+				beyond_model[traces[i].model] += far;
+			}
+		} else if (synthetic && (results[i].path == PATH_NO_BREATH)
+				&& ((peak(&traces[i]) - traces[i].idle) > CLEAR_BREATH_COUNTS)) {
+			missed++;
+			missed_model[traces[i].model]++;
+		}
+	}
+
+	if (synthetic) {
+		printf("%d synthetic breaths (seed 1), ", count);
+	} else {
+		printf("%d recorded breaths, ", count);
+	}
+	printf("BAC_LIMIT %d, %d-bit samples, SENSOR_TAU_MS %d, fixed wait %.1f s\n\n", BAC_LIMIT,
+			ADC_RESULT_BITS, SENSOR_TAU_MS, BAC_RESULT_DELAY_MS / 1000.0);
+	printf("%-14s %7s %8s %7s %7s %7s %11s\n", "result", "traces", "p10 s", "p50 s", "p90 s", "max s",
+			"wrong side");
+	for (int path = PATH_EARLY; path < PATHS; path++) {
+		int n = 0;
+
+		for (int i = 0; i < count; i++) {
+			if (results[i].path == path) {
+				times[n++] = results[i].seconds;
+				all[decided++] = results[i].seconds;
+				bins[(int)(results[i].seconds * 1000.0 / BIN_MS)]++;
+			}
+		}
+		print_path(names[path], times, n, wrong[path], synthetic);
+	}
+	print_path("all", all, decided, wrong_all, synthetic);
+	if (decided < count) {
+		printf("%-14s %7d\n", names[PATH_NONE], count - decided);
+	}
+
+	printf("\npress to result\n");
+	for (int b = 0; b < BINS; b++) {
+		widest = (bins[b] > widest) ? bins[b] : widest;
+	}
+	for (int b = 0; b < BINS; b++) {
+		int bar = (bins[b] * 50 + widest - 1) / widest;
+
+		printf("%4.1f-%4.1f s %5d ", b * BIN_MS / 1000.0, (b + 1) * BIN_MS / 1000.0, bins[b]);
+		for (int i = 0; i < bar; i++) {
+			putchar('#');
+		}
+		putchar('\n');
+	}
+
+	if (synthetic) {
+		printf("\n%-30s %7s %11s %8s %7s %6s\n", "sensor model", "traces", "wrong side", "> margin",
+				"missed", "rate");
+		for (int model = 0; model < MODELS; model++) {
+			int n = (model == MODEL_FIRST_ORDER) ? REPLAY_TRACES : REPLAY_OFF_MODEL_TRACES;
+
+			printf("%-30s %7d %11d %8d %7d %5.1f%%\n", models[model], n,
+					wrong_model[model], beyond_model[model], missed_model[model], (100.0 * missed_model[model]) / n);
+		}
+		printf("\n%d results on the other side of BAC_LIMIT from the level reached, %d by more than %d.%05d %%\n",
+				wrong_all, beyond, WRONG_SIDE_MARGIN / 100000, WRONG_SIDE_MARGIN % 100000);
+		printf("%d breaths rising over %d counts read as no breath (%.1f%%)\n", missed, CLEAR_BREATH_COUNTS,
+				(100.0 * missed) / count);
+	}
+	return (beyond > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
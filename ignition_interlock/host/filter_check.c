@@ -0,0 +1,210 @@
+/**
+ * @file    filter_check.c
+ * @brief   The firmware's fixed-point sensor filter against a double-precision reference.
+ *
+ * Usage: filter_check
+ *
+ * Feeds synthetic sensor traces through FILTER_Median() and FILTER_LowPass()
+ * and through the same filters in double precision, designed from the
+ * FILTER_* settings rather than from the Q14 constants. Fails if an output
+ * is further than MAX_ERROR_COUNTS from the rounded reference, or if a
+ * coefficient no longer matches FILTER_CUTOFF_HZ. Traces are in conversion
+ * counts scaled up to decimated samples. Errors print in sample LSBs; the
+ * limits are in conversion counts, whatever ADC_OVERSAMPLE_BITS. Cycles per
+ * sample on the M0+ come from axf_bench (FILTER_Median and FILTER_LowPass
+ * benchmarks).
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The firmware is built into this file for its FILTER_* settings
+#define main interlock_main
+#include "ignition_interlock.c"
+#undef main
+
+#define TRACE_SAMPLES (2000) // 20 s at ADC_SAMPLE_RATE_HZ
+#define MAX_ERROR_COUNTS (2) // Rounding of the Q3 state and the Q14 coefficients
+#define MAX_COEF_ERROR (1.0) // LSBs of Q14 between a constant and the design
+#define NOISE_COUNTS (15)
+#define SPIKE_EVERY (37) // Samples between single-sample glitches
+#define SAMPLE(counts) ((uint32_t)(counts) << ADC_OVERSAMPLE_BITS)
+#define LIMIT(counts) ((counts) << ADC_OVERSAMPLE_BITS) // Error limit in sample LSBs
+
+typedef struct {
+	double taps[FILTER_MEDIAN_TAPS];
+	int tap;
+	double b[3];
+	double a[3];
+	double x[2];
+	double y[2];
+	int primed;
+} reference_t;
+
+static int compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+// Bilinear-transform Butterworth, as scipy.signal.butter(2, fc / (fs / 2))
+static void design(reference_t *ref)
+{
+	double k = tan(M_PI * FILTER_CUTOFF_HZ / ADC_SAMPLE_RATE_HZ);
+	double norm = 1.0 / (1.0 + (M_SQRT2 * k) + (k * k));
+
+	memset(ref, 0, sizeof(*ref));
+	ref->b[0] = k * k * norm;
+	ref->b[1] = 2.0 * ref->b[0];
+	ref->b[2] = ref->b[0];
+	ref->a[0] = 1.0;
+	ref->a[1] = 2.0 * ((k * k) - 1.0) * norm;
+	ref->a[2] = (1.0 - (M_SQRT2 * k) + (k * k)) * norm;
+}
+
+static double reference_median(reference_t *ref, double x)
+{
+	double sorted[FILTER_MEDIAN_TAPS];
+
+	if (!ref->primed) {
+		for (int i = 0; i < FILTER_MEDIAN_TAPS; i++) {
+			ref->taps[i] = x;
+		}
+	}
+	ref->taps[ref->tap] = x;
+	ref->tap = (ref->tap + 1) % FILTER_MEDIAN_TAPS;
+	memcpy(sorted, ref->taps, sizeof(sorted));
+	qsort(sorted, FILTER_MEDIAN_TAPS, sizeof(double), compare_double);
+	return sorted[FILTER_MEDIAN_TAPS / 2];
+}
+
+static double reference_lowpass(reference_t *ref, double x)
+{
+#if (FILTER_IIR_ORDER == 1)
+	if (!ref->primed) {
+		ref->y[0] = x;
+	}
+	ref->y[0] += (x - ref->y[0]) / (1 << FILTER_EMA_SHIFT);
+	return ref->y[0];
+#elif (FILTER_IIR_ORDER == 2)
+	double y;
+
+	if (!ref->primed) {
+		ref->x[0] = ref->x[1] = ref->y[0] = ref->y[1] = x;
+	}
+	y = (ref->b[0] * x) + (ref->b[1] * ref->x[0]) + (ref->b[2] * ref->x[1])
+			- (ref->a[1] * ref->y[0]) - (ref->a[2] * ref->y[1]);
+	ref->x[1] = ref->x[0];
+	ref->x[0] = x;
+	ref->y[1] = ref->y[0];
+	ref->y[0] = y;
+	return (y < 0) ? 0 : (y > SAMPLE_MAX) ? SAMPLE_MAX : y;
+#else
+	return x;
+#endif
+}
+
+static int check_coefficients(const reference_t *ref)
+{
+	const double scale = 1 << FILTER_COEF_Q;
+	const double fixed[5] = {FILTER_B0, FILTER_B1, FILTER_B2, FILTER_A1, FILTER_A2};
+	const double ideal[5] = {ref->b[0], ref->b[1], ref->b[2], ref->a[1], ref->a[2]};
+	const char *names[5] = {"b0", "b1", "b2", "a1", "a2"};
+	int ok = 1;
+
+	for (int i = 0; i < 5; i++) {
+		double error = fixed[i] - (ideal[i] * scale);
+
+		if (fabs(error) > MAX_COEF_ERROR) {
+			printf("FILTER_%c%c is %.0f, the %d Hz design needs %.1f\n", names[i][0] - 32, names[i][1],
+					fixed[i], FILTER_CUTOFF_HZ, ideal[i] * scale);
+			ok = 0;
+		}
+	}
+	return ok;
+}
+
+static uint32_t breath(int n)
+{
+	// Idle, a 3 s breath rising to 2600 counts, then the sensor recovering
+	double t = (double)n / ADC_SAMPLE_RATE_HZ;
+	double level = 2000.0;
+
+	if ((t >= 2.0) && (t < 5.0)) {
+		level += 600.0 * (1.0 - exp(-(t - 2.0) / 0.4));
+	} else if (t >= 5.0) {
+		level += 600.0 * (1.0 - exp(-3.0 / 0.4)) * exp(-(t - 5.0) / 1.5);
+	}
+	return (uint32_t)level;
+}
+
+static uint32_t trace(int kind, int n)
+{
+	int noise = (rand() % ((2 * NOISE_COUNTS) + 1)) - NOISE_COUNTS;
+	int x;
+
+	switch (kind) {
+	case 0:	// step
+		return SAMPLE((n < (TRACE_SAMPLES / 2)) ? 2000 : 2600);
+	case 1:	// full-scale steps, the overshoot must be clamped
+		return ((n / 200) & 1) ? SAMPLE_MAX : 0;
+	default:	// breath with noise and glitches to either rail
+		x = (int)breath(n) + noise;
+		if ((n > 0) && ((n % SPIKE_EVERY) == 0)) {
+			x = ((n / SPIKE_EVERY) & 1) ? ADC_MAX : 0;
+		}
+		return SAMPLE((x < 0) ? 0 : (x > ADC_MAX) ? ADC_MAX : x);
+	}
+}
+
+int main(void)
+{
+	static const char *const kinds[] = {"step", "rail steps", "breath+noise+spikes"};
+	reference_t ref;
+	int failed = 0;
+
+	design(&ref);
+	printf("median of %d, IIR order %d", FILTER_MEDIAN_TAPS, FILTER_IIR_ORDER);
+	if (FILTER_IIR_ORDER == 2) {
+		printf(", %d Hz at %d Hz: b = {%.6f, %.6f, %.6f} a = {1, %.6f, %.6f}\n", FILTER_CUTOFF_HZ,
+				ADC_SAMPLE_RATE_HZ, ref.b[0], ref.b[1], ref.b[2], ref.a[1], ref.a[2]);
+		failed |= !check_coefficients(&ref);
+	} else {
+		printf("\n");
+	}
+
+	srand(1);
+	printf("%-22s %12s %12s %14s\n", "trace", "median err", "lowpass err", "spikes passed");
+	for (int kind = 0; kind < 3; kind++) {
+		int median_error = 0;
+		int lowpass_error = 0;
+		int spikes = 0;
+
+		design(&ref);
+		FILTER_Reset();
+		for (int n = 0; n < TRACE_SAMPLES; n++) {
+			uint32_t x = trace(kind, n);
+			uint32_t median = FILTER_Median(x);
+			uint32_t out = FILTER_LowPass(median);
+			double ref_median = reference_median(&ref, x);
+			double ref_out = reference_lowpass(&ref, ref_median);
+			int e1 = abs((int)median - (int)lround(ref_median));
+			int e2 = abs((int)out - (int)lround(ref_out));
+
+			ref.primed = 1;
+			median_error = (e1 > median_error) ? e1 : median_error;
+			lowpass_error = (e2 > lowpass_error) ? e2 : lowpass_error;
+			spikes += (kind == 2) && ((median == 0) || (median == SAMPLE(ADC_MAX)));
+		}
+		printf("%-22s %12d %12d %14d\n", kinds[kind], median_error, lowpass_error, spikes);
+		failed |= (median_error > 0) || (lowpass_error > LIMIT(MAX_ERROR_COUNTS));
+	}
+	if (failed) {
+		printf("\nfixed-point filter is off the reference by more than %d counts\n", MAX_ERROR_COUNTS);
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
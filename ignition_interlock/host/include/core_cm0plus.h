@@ -0,0 +1,208 @@
+/**
+ * @file    core_cm0plus.h
+ * @brief   Host stand-in for the CMSIS Cortex-M0+ core header.
+ *
+ * Found before CMSIS/ on the host include path, so device/LPC802.h and the
+ * drivers compile unchanged. Register blocks keep their real addresses (the
+ * simulator maps RAM there); the intrinsics and the NVIC, which have no
+ * memory-mapped meaning on the host, call into the simulator instead.
+ */
+
+#ifndef __CORE_CM0PLUS_H_GENERIC
+#define __CORE_CM0PLUS_H_GENERIC
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __CM0PLUS_CMSIS_VERSION_MAIN (5U)
+#define __CM0PLUS_CMSIS_VERSION_SUB (4U)
+#define __CORTEX_M (0U)
+#define __FPU_USED (0U)
+
+#define __ASM __asm__
+#define __INLINE inline
+#define __STATIC_INLINE static inline
+#define __STATIC_FORCEINLINE static inline __attribute__((always_inline))
+#define __NO_RETURN __attribute__((__noreturn__))
+#define __USED __attribute__((used))
+#define __WEAK __attribute__((weak))
+#define __PACKED __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT struct __attribute__((packed, aligned(1)))
+#define __ALIGNED(x) __attribute__((aligned(x)))
+#define __RESTRICT __restrict
+
+#define __I volatile const
+#define __O volatile
+#define __IO volatile
+#define __IM volatile const
+#define __OM volatile
+#define __IOM volatile
+
+// Implemented by host/sim/lpc802_sim.c
+void sim_disable_irq(void);
+void sim_enable_irq(void);
+uint32_t sim_get_primask(void);
+void sim_set_primask(uint32_t primask);
+void sim_wfi(void);
+void sim_nvic_enable(int32_t irqn);
+void sim_nvic_disable(int32_t irqn);
+uint32_t sim_nvic_is_enabled(int32_t irqn);
+void sim_nvic_set_pending(int32_t irqn);
+void sim_nvic_clear_pending(int32_t irqn);
+uint32_t sim_nvic_is_pending(int32_t irqn);
+void sim_system_reset(void);
+
+#define __disable_irq() sim_disable_irq()
+#define __enable_irq() sim_enable_irq()
+#define __get_PRIMASK() sim_get_primask()
+#define __set_PRIMASK(x) sim_set_primask(x)
+#define __WFI() sim_wfi()
+#define __WFE() sim_wfi()
+#define __SEV() ((void)0)
+#define __NOP() ((void)0)
+#define __DSB() __sync_synchronize()
+#define __DMB() __sync_synchronize()
+#define __ISB() __sync_synchronize()
+#define __BKPT(x) ((void)0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CORE_CM0PLUS_H_GENERIC */
+
+#ifndef __CORE_CM0PLUS_H_DEPENDANT
+#define __CORE_CM0PLUS_H_DEPENDANT
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	__IOM uint32_t ISER[1U];
+	uint32_t RESERVED0[31U];
+	__IOM uint32_t ICER[1U];
+	uint32_t RSERVED1[31U];
+	__IOM uint32_t ISPR[1U];
+	uint32_t RESERVED2[31U];
+	__IOM uint32_t ICPR[1U];
+	uint32_t RESERVED3[31U];
+	uint32_t RESERVED4[64U];
+	__IOM uint32_t IP[8U];
+} NVIC_Type;
+
+typedef struct {
+	__IM uint32_t CPUID;
+	__IOM uint32_t ICSR;
+	__IOM uint32_t VTOR;
+	__IOM uint32_t AIRCR;
+	__IOM uint32_t SCR;
+	__IOM uint32_t CCR;
+	uint32_t RESERVED1;
+	__IOM uint32_t SHP[2U];
+	__IOM uint32_t SHCSR;
+} SCB_Type;
+
+#define SCB_SCR_SEVONPEND_Pos 4U
+#define SCB_SCR_SEVONPEND_Msk (1UL << SCB_SCR_SEVONPEND_Pos)
+#define SCB_SCR_SLEEPDEEP_Pos 2U
+#define SCB_SCR_SLEEPDEEP_Msk (1UL << SCB_SCR_SLEEPDEEP_Pos)
+#define SCB_SCR_SLEEPONEXIT_Pos 1U
+#define SCB_SCR_SLEEPONEXIT_Msk (1UL << SCB_SCR_SLEEPONEXIT_Pos)
+
+typedef struct {
+	__IOM uint32_t CTRL;
+	__IOM uint32_t LOAD;
+	__IOM uint32_t VAL;
+	__IM uint32_t CALIB;
+} SysTick_Type;
+
+#define SysTick_CTRL_COUNTFLAG_Pos 16U
+#define SysTick_CTRL_COUNTFLAG_Msk (1UL << SysTick_CTRL_COUNTFLAG_Pos)
+#define SysTick_CTRL_CLKSOURCE_Pos 2U
+#define SysTick_CTRL_CLKSOURCE_Msk (1UL << SysTick_CTRL_CLKSOURCE_Pos)
+#define SysTick_CTRL_TICKINT_Pos 1U
+#define SysTick_CTRL_TICKINT_Msk (1UL << SysTick_CTRL_TICKINT_Pos)
+#define SysTick_CTRL_ENABLE_Pos 0U
+#define SysTick_CTRL_ENABLE_Msk (1UL)
+#define SysTick_LOAD_RELOAD_Pos 0U
+#define SysTick_LOAD_RELOAD_Msk (0xFFFFFFUL)
+#define SysTick_VAL_CURRENT_Pos 0U
+#define SysTick_VAL_CURRENT_Msk (0xFFFFFFUL)
+
+#define SCS_BASE (0xE000E000UL)
+#define SysTick_BASE (SCS_BASE + 0x0010UL)
+#define NVIC_BASE (SCS_BASE + 0x0100UL)
+#define SCB_BASE (SCS_BASE + 0x0D00UL)
+
+#define SCB ((SCB_Type *)SCB_BASE)
+#define SysTick ((SysTick_Type *)SysTick_BASE)
+#define NVIC ((NVIC_Type *)NVIC_BASE)
+
+__STATIC_INLINE void NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+	sim_nvic_enable((int32_t)IRQn);
+}
+
+__STATIC_INLINE uint32_t NVIC_GetEnableIRQ(IRQn_Type IRQn)
+{
+	return sim_nvic_is_enabled((int32_t)IRQn);
+}
+
+__STATIC_INLINE void NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+	sim_nvic_disable((int32_t)IRQn);
+}
+
+__STATIC_INLINE uint32_t NVIC_GetPendingIRQ(IRQn_Type IRQn)
+{
+	return sim_nvic_is_pending((int32_t)IRQn);
+}
+
+__STATIC_INLINE void NVIC_SetPendingIRQ(IRQn_Type IRQn)
+{
+	sim_nvic_set_pending((int32_t)IRQn);
+}
+
+__STATIC_INLINE void NVIC_ClearPendingIRQ(IRQn_Type IRQn)
+{
+	sim_nvic_clear_pending((int32_t)IRQn);
+}
+
+__STATIC_INLINE void NVIC_SetPriority(IRQn_Type IRQn, uint32_t priority)
+{
+	// Every IRQ runs at the same priority in the simulator
+	(void)IRQn;
+	(void)priority;
+}
+
+__STATIC_INLINE uint32_t NVIC_GetPriority(IRQn_Type IRQn)
+{
+	(void)IRQn;
+	return 0U;
+}
+
+__STATIC_INLINE void NVIC_SystemReset(void)
+{
+	sim_system_reset();
+}
+
+__STATIC_INLINE uint32_t SysTick_Config(uint32_t ticks)
+{
+	if ((ticks - 1UL) > SysTick_LOAD_RELOAD_Msk) {
+		return 1UL;
+	}
+	SysTick->LOAD = (uint32_t)(ticks - 1UL);
+	SysTick->VAL = 0UL;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+	return 0UL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CORE_CM0PLUS_H_DEPENDANT */
@@ -0,0 +1,181 @@
+/**
+ * @file    interlock_sim.c
+ * @brief   Runs one breath test session of the firmware on the host.
+ *
+ * Usage: interlock_sim [--mmio] [--bounce <ms>] [breath_level]
+ * The sensor idles at SENSOR_IDLE_LEVEL, the driver blows for BREATH_MS and
+ * the sensor follows with first-order lags towards breath_level (12-bit ADC
+ * counts) and back. The panel contents are printed at every step, the
+ * result as soon as the firmware has one, and after each press the time
+ * until the panel holds the new text (simulated time: the LCD refresh ticks
+ * and any timers, not the CPU's own cycles). The run ends in power-down, or
+ * with DPD_ENABLE in deep power-down after the inactivity timeout.
+ * --bounce presses again <ms> after the first press: a bouncing contact,
+ * or a driver pressing before the result. The session must not change.
+ * --mmio adds the register access table of sim/mmio_trace.c; keep it as a
+ * baseline and diff it in review.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lpc802_sim.h"
+#include "mmio_trace.h"
+
+#define SENSOR_IDLE_LEVEL (2000) // ADC counts with clean air
+#define PRESS_AT_MS (1000) // Start the session
+#define BREATH_AT_MS (2500) // After the baseline window at 100 Hz
+#define BREATH_MS (3000)
+#define SENSOR_RISE_MS (300) // Time constants of the sensor response
+#define SENSOR_DECAY_MS (800)
+#define RESULT_POLL_MS (10)
+#define PANEL_POLL_US (5)
+#define RESULT_BY_MS (PRESS_AT_MS + 8000 + 100) // Just after BAC_RESULT_DELAY_MS
+#define SHUTDOWN_AT_MS (12000) // Second press: car off or retry
+#define RUN_FOR_MS (SHUTDOWN_AT_MS + 70000) // Past the idle timeout
+
+// Firmware state, see source/ignition_interlock.c
+int interlock_main(void);
+extern char volatile lcd_shadow[32];
+extern int volatile lcd_dirty;
+extern int volatile bac;
+extern int bac_checked;
+extern int readings;
+extern int lights_on;
+extern int session_active;
+
+static uint16_t breath_level = 2200;	// 0.06 %: under the limit
+static uint64_t pressed_us;
+static long bounce_ms = -1;	// Extra press after the first, off while negative
+
+static uint16_t sensor(uint64_t t_us)
+{
+	double t_ms = t_us / 1000.0;
+	double swing = breath_level - SENSOR_IDLE_LEVEL;
+	double blown;
+
+	if (t_ms < BREATH_AT_MS) {
+		return SENSOR_IDLE_LEVEL;
+	}
+	if (t_ms < (BREATH_AT_MS + BREATH_MS)) {
+		blown = 1.0 - exp(-(t_ms - BREATH_AT_MS) / SENSOR_RISE_MS);
+	} else {
+		blown = (1.0 - exp(-(double)BREATH_MS / SENSOR_RISE_MS))
+				* exp(-(t_ms - BREATH_AT_MS - BREATH_MS) / SENSOR_DECAY_MS);
+	}
+	return (uint16_t)lround(SENSOR_IDLE_LEVEL + (swing * blown));
+}
+
+static void print_lcd(const char *when)
+{
+	printf("%8.3f s  %-10s |", sim_now_us() / 1e6, when);
+	for (int i = 0; i < 16; i++) {
+		putchar(lcd_shadow[i]);
+	}
+	printf("|  bac=%d readings=%d lights=%d session=%d\n",
+			bac, readings, lights_on, session_active);
+	printf("%24s|", "");
+	for (int i = 16; i < 32; i++) {
+		putchar(lcd_shadow[i]);
+	}
+	printf("|\n");
+}
+
+static void show_boot(void)
+{
+	print_lcd("boot");
+}
+
+static void panel_settled(void)
+{
+	// The press is handled once main() wakes up; the refresh task then
+	// sends the changed cells
+	if (lcd_dirty || (sim_now_us() == pressed_us)) {
+		sim_at(sim_now_us() + PANEL_POLL_US, panel_settled);
+	} else {
+		printf("%8.3f s  panel done %llu us after the press\n", sim_now_us() / 1e6,
+				(unsigned long long)(sim_now_us() - pressed_us));
+	}
+}
+
+static void press(void)
+{
+	pressed_us = sim_now_us();
+	sim_press_button();
+	sim_at(pressed_us + PANEL_POLL_US, panel_settled);
+}
+
+static void show_press(void)
+{
+	print_lcd("press");
+}
+
+static void show_result(void)
+{
+	// From the breath detector, or BAC_RESULT_DELAY_MS after the press
+	if (bac_checked) {
+		print_lcd("result");
+	} else if (sim_now_us() < (RESULT_BY_MS * 1000U)) {
+		sim_at(sim_now_us() + (RESULT_POLL_MS * 1000U), show_result);
+	} else {
+		print_lcd("no result");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const reasons[] = {
+		[SIM_EXIT_TIME_UP] = "time up",
+		[SIM_EXIT_DEEP_POWER_DOWN] = "deep power-down",
+		[SIM_EXIT_RESET] = "system reset",
+		[SIM_EXIT_RETURNED] = "main() returned",
+	};
+	int reason;
+	int mmio = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--mmio") == 0) {
+			mmio = 1;
+		} else if ((strcmp(argv[i], "--bounce") == 0) && ((i + 1) < argc)) {
+			bounce_ms = strtol(argv[++i], NULL, 0);
+		} else {
+			breath_level = (uint16_t)strtoul(argv[i], NULL, 0);
+		}
+	}
+
+	sim_init();
+	sim_adc_set_source(sensor);
+	sim_at(100U * 1000U, show_boot);
+	sim_at(PRESS_AT_MS * 1000U, press);
+	sim_at((PRESS_AT_MS + 10U) * 1000U, show_press);
+	sim_at((PRESS_AT_MS + RESULT_POLL_MS) * 1000U, show_result);
+	if (bounce_ms >= 0) {
+		sim_at((PRESS_AT_MS + bounce_ms) * 1000U, press);
+		sim_at((PRESS_AT_MS + bounce_ms + 10U) * 1000U, show_press);
+	}
+	sim_at(SHUTDOWN_AT_MS * 1000U, press);
+	sim_at((SHUTDOWN_AT_MS + 10U) * 1000U, show_press);
+
+	if (mmio) {
+		mmio_trace_start();
+	}
+	reason = sim_run(interlock_main, RUN_FOR_MS * 1000U);
+	print_lcd("end");
+
+	printf("\nstopped at %.3f s: %s\n", sim_now_us() / 1e6, reasons[reason]);
+	printf("adc conversions %u, sleep %u (%.3f s), power-down %u (%.3f s)\n",
+			sim_stats.adc_conversions,
+			sim_stats.wfi_sleep, sim_stats.sleep_ns / 1e9,
+			sim_stats.wfi_power_down, sim_stats.power_down_ns / 1e9);
+	printf("irqs: MRT0 %u, WKT %u, ADC SEQA %u, ADC THCMP %u, PIN_INT0 %u\n",
+			sim_stats.irqs[MRT0_IRQn], sim_stats.irqs[WKT_IRQn],
+			sim_stats.irqs[ADC0_SEQA_IRQn], sim_stats.irqs[ADC0_THCMP_IRQn],
+			sim_stats.irqs[PIN_INT0_IRQn]);
+	if (mmio) {
+		printf("\n");
+		mmio_trace_report(stdout);
+	}
+	return ((reason == SIM_EXIT_TIME_UP) || (reason == SIM_EXIT_DEEP_POWER_DOWN)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
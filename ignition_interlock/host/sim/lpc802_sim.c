@@ -0,0 +1,598 @@
+/**
+ * @file    lpc802_sim.c
+ * @brief   RAM-backed LPC802 for running the firmware on the host.
+ *
+ * Registers are ordinary memory, so the simulator can only see what the
+ * firmware left in them. It interprets that state each time the firmware
+ * waits in __WFI(): LOAD bits start MRT channels, a new WKT COUNT starts
+ * the wake-up timer, CTIMER0 runs while CEN is set. Flags that hardware
+ * clears on a write of 1 are raised just before their handler runs and
+ * dropped once it returns. Busy-waits on such a flag (delay_us()) complete
+ * at once, because the clearing write leaves the bit set in RAM.
+ */
+
+#define _GNU_SOURCE
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lpc802_sim.h"
+#include "mmio_trace.h"
+#include "fsl_clock.h"
+#include "fsl_power.h"
+#include "rom_api.h"
+
+#define NS_PER_S (1000000000ULL)
+#define SIM_NEVER (UINT64_MAX)
+#define SIM_LPOSC_HZ (10000ULL) // WKT clock
+#define SIM_ADC_TRIG_T0_MAT3 (5) // SEQ_CTRL TRIGGER input wired to CTIMER0 MAT3
+#define SIM_MRT_CHANNELS (2)
+
+// Write a register the firmware only reads (__I)
+#define SIM_WR(reg, val) (*(uint32_t volatile *)&(reg) = (val))
+
+typedef struct {
+	uint64_t t_ns;
+	void (*action)(void);
+} sim_action_t;
+
+typedef struct {
+	uintptr_t base;
+	size_t size;
+} sim_region_t;
+
+static const sim_region_t sim_regions[] = {
+	{0x0F001000u, 0x1000u},	// boot ROM driver table pointer
+	{0x40000000u, 0x70000u},	// APB peripherals
+	{0x50000000u, 0x1000u},	// CRC
+	{0xA0000000u, 0x8000u},	// GPIO, PINT
+	{SCS_BASE, 0x1000u},	// SCB, SysTick (the NVIC is modelled below)
+};
+
+sim_stats_t sim_stats;
+
+static uint64_t now_ns;
+static uint64_t until_ns;
+static jmp_buf exit_jmp;
+static uint32_t primask;
+static int in_handler;
+static uint32_t nvic_enabled;
+static uint32_t nvic_pending;
+
+static sim_action_t actions[SIM_MAX_ACTIONS];
+static uint32_t action_count;
+
+static uint64_t mrt_expiry[SIM_MRT_CHANNELS];
+static uint64_t ctimer_next;
+static uint32_t ctimer_mr3;
+static uint32_t ctimer_mat3;
+static uint64_t wkt_expiry;
+static uint32_t wkt_count_seen;
+static uint16_t (*adc_source)(uint64_t t_us);
+
+void Sim_DefaultHandler(void);
+void MRT0_IRQHandler(void) __attribute__((weak, alias("Sim_DefaultHandler")));
+void WKT_IRQHandler(void) __attribute__((weak, alias("Sim_DefaultHandler")));
+void ADC0_SEQA_IRQHandler(void) __attribute__((weak, alias("Sim_DefaultHandler")));
+void ADC0_THCMP_IRQHandler(void) __attribute__((weak, alias("Sim_DefaultHandler")));
+void CTIMER0_IRQHandler(void) __attribute__((weak, alias("Sim_DefaultHandler")));
+void PIN_INT0_IRQHandler(void) __attribute__((weak, alias("Sim_DefaultHandler")));
+
+static void (*const sim_vectors[SIM_IRQ_COUNT])(void) = {
+	[MRT0_IRQn] = MRT0_IRQHandler,
+	[WKT_IRQn] = WKT_IRQHandler,
+	[ADC0_SEQA_IRQn] = ADC0_SEQA_IRQHandler,
+	[ADC0_THCMP_IRQn] = ADC0_THCMP_IRQHandler,
+	[CTIMER0_IRQn] = CTIMER0_IRQHandler,
+	[PIN_INT0_IRQn] = PIN_INT0_IRQHandler,
+};
+
+// SystemInit() points VTOR here; dispatch goes through sim_vectors[]
+void *__Vectors;
+
+static void sim_set_fro_frequency(unsigned frequency)
+{
+	(void)frequency;	// fsl_clock.c keeps g_Fro_Osc_Freq itself
+}
+
+static const PWRD_API_T sim_pwrd = {
+	.set_fro_frequency = sim_set_fro_frequency,
+};
+
+static const LPC_ROM_API_T sim_rom = {
+	.pPWRD = &sim_pwrd,
+};
+
+void Sim_DefaultHandler(void)
+{
+}
+
+static void map_regions(void)
+{
+	static int mapped = 0;
+
+	for (size_t i = 0; i < (sizeof(sim_regions) / sizeof(sim_regions[0])); i++) {
+		void *want = (void *)sim_regions[i].base;
+
+		if (mapped) {
+			memset(want, 0, sim_regions[i].size);
+			continue;
+		}
+		if (mmap(want, sim_regions[i].size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != want) {
+			fprintf(stderr, "sim: cannot map registers at %p\n", want);
+			exit(EXIT_FAILURE);
+		}
+	}
+	mapped = 1;
+}
+
+static uint64_t ticks_to_ns(uint64_t ticks)
+{
+	uint32_t hz = CLOCK_GetCoreSysClkFreq();
+
+	return (hz == 0) ? SIM_NEVER : ((ticks * NS_PER_S) / hz);
+}
+
+static int clocked(uint32_t ahb_mask)
+{
+	return (SYSCON->SYSAHBCLKCTRL0 & ahb_mask) != 0;
+}
+
+static void pend(int32_t irqn)
+{
+	nvic_pending |= (1UL<<irqn);
+}
+
+static void clear_flags(uint32_t irqn)
+{
+	// What the handler cleared with a write of 1 is still set in RAM
+	switch (irqn) {
+	case MRT0_IRQn:
+		MRT0->IRQ_FLAG = 0;
+		for (int n = 0; n < SIM_MRT_CHANNELS; n++) {
+			MRT0->CHANNEL[n].STAT &= ~(MRT_CHANNEL_STAT_INTFLAG_MASK);
+		}
+		break;
+	case PIN_INT0_IRQn:
+		PINT->IST &= ~(1UL<<0);
+		PINT->FALL &= ~(1UL<<0);
+		break;
+	case ADC0_SEQA_IRQn:
+		SIM_WR(ADC0->SEQ_GDAT[0], ADC0->SEQ_GDAT[0] & ~(ADC_SEQ_GDAT_DATAVALID_MASK));
+		break;
+	case ADC0_THCMP_IRQn:
+		ADC0->FLAGS = 0;
+		break;
+	case WKT_IRQn:
+		WKT->CTRL &= ~(WKT_CTRL_ALARMFLAG_MASK);
+		break;
+	default:
+		break;
+	}
+}
+
+static void sync_pint(void)
+{
+	// SIENF and CIENF set and clear bits of IENF; in RAM they keep the last
+	// write, so fold them in after every stretch of firmware code
+	PINT->IENF = (PINT->IENF | PINT->SIENF) & ~PINT->CIENF;
+	PINT->SIENF = 0;
+	PINT->CIENF = 0;
+}
+
+static void dispatch(void)
+{
+	// Equal priorities: no nesting, lowest IRQ number first
+	uint32_t ready;
+
+	if (primask || in_handler) {
+		return;
+	}
+	while ((ready = (nvic_pending & nvic_enabled)) != 0) {
+		uint32_t n = (uint32_t)__builtin_ctz(ready);
+		uint32_t saved;
+
+		nvic_pending &= ~(1UL<<n);
+		in_handler = 1;
+		saved = mmio_irq_begin();
+		sim_vectors[n] ? sim_vectors[n]() : Sim_DefaultHandler();
+		mmio_irq_end(saved);
+		mmio_sim_begin();
+		clear_flags(n);
+		sync_pint();
+		mmio_sim_end();
+		in_handler = 0;
+		sim_stats.irqs[n]++;
+	}
+}
+
+static void adc_convert(uint16_t sample)
+{
+	uint32_t seq = ADC0->SEQ_CTRL[0];
+	uint32_t channels = seq & ADC_SEQ_CTRL_CHANNELS_MASK;
+	uint32_t ch;
+	uint32_t low;
+	uint32_t high;
+	uint32_t result;
+
+	if (!clocked(SYSCON_SYSAHBCLKCTRL0_ADC_MASK) || (SYSCON->PDRUNCFG & SYSCON_PDRUNCFG_ADC_PD_MASK)
+			|| !(seq & ADC_SEQ_CTRL_SEQ_ENA_MASK) || (channels == 0)) {
+		return;
+	}
+	sample &= 0xFFF;
+	ch = (uint32_t)__builtin_ctz(channels);
+	result = ADC_SEQ_GDAT_DATAVALID_MASK | ADC_SEQ_GDAT_RESULT(sample) | ADC_SEQ_GDAT_CHN(ch);
+	SIM_WR(ADC0->SEQ_GDAT[0], result);
+	SIM_WR(ADC0->DAT[ch], result);
+	sim_stats.adc_conversions++;
+
+	if (ADC0->INTEN & ADC_INTEN_SEQA_INTEN_MASK) {
+		pend(ADC0_SEQA_IRQn);
+	}
+
+	// Threshold compare, "outside threshold" interrupts only
+	if (ADC0->CHAN_THRSEL & (1UL<<ch)) {
+		low = (ADC0->THR1_LOW & ADC_THR1_LOW_THRLOW_MASK) >> ADC_THR1_LOW_THRLOW_SHIFT;
+		high = (ADC0->THR1_HIGH & ADC_THR1_HIGH_THRHIGH_MASK) >> ADC_THR1_HIGH_THRHIGH_SHIFT;
+	} else {
+		low = (ADC0->THR0_LOW & ADC_THR0_LOW_THRLOW_MASK) >> ADC_THR0_LOW_THRLOW_SHIFT;
+		high = (ADC0->THR0_HIGH & ADC_THR0_HIGH_THRHIGH_MASK) >> ADC_THR0_HIGH_THRHIGH_SHIFT;
+	}
+	if ((sample < low) || (sample > high)) {
+		ADC0->FLAGS |= (1UL<<ch);
+		if (((ADC0->INTEN >> (ADC_INTEN_ADCMPINTEN0_SHIFT + (2 * ch))) & 0x3) == 1) {
+			pend(ADC0_THCMP_IRQn);
+		}
+	}
+}
+
+static void sync_registers(void)
+{
+	// Pick up what the firmware wrote since the last look
+	for (int n = 0; n < SIM_MRT_CHANNELS; n++) {
+		uint32_t intval = MRT0->CHANNEL[n].INTVAL;
+		uint32_t remaining = 0;
+
+		if (intval & MRT_CHANNEL_INTVAL_LOAD_MASK) {
+			uint32_t ivalue = intval & MRT_CHANNEL_INTVAL_IVALUE_MASK;
+
+			MRT0->CHANNEL[n].INTVAL = ivalue;
+			mrt_expiry[n] = (ivalue != 0) ? (now_ns + ticks_to_ns(ivalue)) : SIM_NEVER;
+		}
+		if (mrt_expiry[n] != SIM_NEVER) {
+			if (mrt_expiry[n] > now_ns) {	// else frozen past it in power-down
+				remaining = (uint32_t)(((mrt_expiry[n] - now_ns) * CLOCK_GetCoreSysClkFreq()) / NS_PER_S);
+			}
+			MRT0->CHANNEL[n].STAT |= MRT_CHANNEL_STAT_RUN_MASK;
+		} else {
+			MRT0->CHANNEL[n].STAT &= ~(MRT_CHANNEL_STAT_RUN_MASK);
+		}
+		SIM_WR(MRT0->CHANNEL[n].TIMER, remaining);
+	}
+
+	if (!clocked(SYSCON_SYSAHBCLKCTRL0_CTIMER0_MASK) || !(CTIMER0->TCR & CTIMER_TCR_CEN_MASK)
+			|| (CTIMER0->TCR & CTIMER_TCR_CRST_MASK)) {
+		ctimer_next = SIM_NEVER;
+	} else if ((ctimer_next == SIM_NEVER) || (CTIMER0->MR[3] != ctimer_mr3)) {
+		// Started, or restarted with a new period by CTIMER_SetSampleRate()
+		ctimer_mr3 = CTIMER0->MR[3];
+		ctimer_next = now_ns + ticks_to_ns((uint64_t)ctimer_mr3 + 1);
+	}
+
+	if (WKT->COUNT != wkt_count_seen) {
+		wkt_expiry = now_ns + ((WKT->COUNT * NS_PER_S) / SIM_LPOSC_HZ);
+	} else if (WKT->CTRL & WKT_CTRL_CLEARCTR_MASK) {
+		wkt_expiry = SIM_NEVER;
+	}
+	if (WKT->CTRL & WKT_CTRL_CLEARCTR_MASK) {
+		WKT->CTRL &= ~(WKT_CTRL_CLEARCTR_MASK | WKT_CTRL_ALARMFLAG_MASK);
+	}
+	wkt_count_seen = (wkt_expiry == SIM_NEVER) ? 0 : (uint32_t)(((wkt_expiry - now_ns) * SIM_LPOSC_HZ) / NS_PER_S);
+	WKT->COUNT = wkt_count_seen;
+}
+
+static uint64_t next_event(int deep)
+{
+	// MRT and CTIMER0 run from the system clock, stopped in power-down
+	uint64_t next = SIM_NEVER;
+
+	if (action_count != 0) {
+		next = actions[0].t_ns;
+	}
+	if (wkt_expiry < next) {
+		next = wkt_expiry;
+	}
+	if (!deep) {
+		for (int n = 0; n < SIM_MRT_CHANNELS; n++) {
+			if (mrt_expiry[n] < next) {
+				next = mrt_expiry[n];
+			}
+		}
+		if (ctimer_next < next) {
+			next = ctimer_next;
+		}
+	}
+	return next;
+}
+
+static void run_events(int deep)
+{
+	while ((action_count != 0) && (actions[0].t_ns <= now_ns)) {
+		void (*action)(void) = actions[0].action;
+
+		action_count--;
+		memmove(&actions[0], &actions[1], action_count * sizeof(actions[0]));
+		action();
+	}
+	if (wkt_expiry <= now_ns) {
+		wkt_expiry = SIM_NEVER;
+		WKT->CTRL |= WKT_CTRL_ALARMFLAG_MASK;
+		pend(WKT_IRQn);
+	}
+	if (deep) {
+		return;
+	}
+	for (int n = 0; n < SIM_MRT_CHANNELS; n++) {
+		if (mrt_expiry[n] <= now_ns) {
+			uint32_t ctrl = MRT0->CHANNEL[n].CTRL;
+			uint32_t ivalue = MRT0->CHANNEL[n].INTVAL & MRT_CHANNEL_INTVAL_IVALUE_MASK;
+
+			MRT0->CHANNEL[n].STAT |= MRT_CHANNEL_STAT_INTFLAG_MASK;
+			MRT0->IRQ_FLAG |= (1UL<<n);
+			if (ctrl & MRT_CHANNEL_CTRL_INTEN_MASK) {
+				pend(MRT0_IRQn);
+			}
+			if (((ctrl & MRT_CHANNEL_CTRL_MODE_MASK) == 0) && (ivalue != 0)) {
+				mrt_expiry[n] += ticks_to_ns(ivalue);	// repeat mode
+			} else {
+				mrt_expiry[n] = SIM_NEVER;
+			}
+		}
+	}
+	if (ctimer_next <= now_ns) {
+		// MR3 match: reset the count and drive MAT3 as EMC3 says; its
+		// rising edge triggers an ADC sequence
+		uint32_t was = ctimer_mat3;
+
+		switch ((CTIMER0->EMR & CTIMER_EMR_EMC3_MASK) >> CTIMER_EMR_EMC3_SHIFT) {
+		case 1:
+			ctimer_mat3 = 0;
+			break;
+		case 2:
+			ctimer_mat3 = 1;
+			break;
+		case 3:
+			ctimer_mat3 ^= 1;
+			break;
+		default:	// do nothing
+			break;
+		}
+		CTIMER0->EMR = (CTIMER0->EMR & ~(CTIMER_EMR_EM3_MASK)) | (ctimer_mat3 ? CTIMER_EMR_EM3_MASK : 0);
+		ctimer_next += ticks_to_ns((uint64_t)ctimer_mr3 + 1);
+		if (ctimer_mat3 && !was && (((ADC0->SEQ_CTRL[0] & ADC_SEQ_CTRL_TRIGGER_MASK) >> ADC_SEQ_CTRL_TRIGGER_SHIFT)
+				== SIM_ADC_TRIG_T0_MAT3)) {
+			adc_convert(adc_source ? adc_source(now_ns / 1000) : 0);
+		}
+	}
+}
+
+void sim_init(void)
+{
+	map_regions();
+	*(const LPC_ROM_API_T **)ROM_DRIVER_BASE = &sim_rom;
+
+	// The reset values the firmware depends on
+	SYSCON->SYSAHBCLKDIV = 1;
+	SYSCON->SYSAHBCLKCTRL0 = SYSCON_SYSAHBCLKCTRL0_SYS_MASK | SYSCON_SYSAHBCLKCTRL0_ROM_MASK
+			| SYSCON_SYSAHBCLKCTRL0_RAM0_MASK | SYSCON_SYSAHBCLKCTRL0_FLASH_MASK;
+	SYSCON->PDRUNCFG = SYSCON_PDRUNCFG_BOD_PD_MASK | SYSCON_PDRUNCFG_ADC_PD_MASK | SYSCON_PDRUNCFG_LPOSC_PD_MASK;
+	memset((void *)&SWM0->PINASSIGN, 0xFF, sizeof(SWM0->PINASSIGN));
+	SWM0->PINENABLE0 = 0xFFFFFFFFU;
+
+	memset(&sim_stats, 0, sizeof(sim_stats));
+	now_ns = 0;
+	primask = 0;
+	in_handler = 0;
+	nvic_enabled = 0;
+	nvic_pending = 0;
+	action_count = 0;
+	for (int n = 0; n < SIM_MRT_CHANNELS; n++) {
+		mrt_expiry[n] = SIM_NEVER;
+	}
+	ctimer_next = SIM_NEVER;
+	ctimer_mr3 = 0;
+	ctimer_mat3 = 0;
+	wkt_expiry = SIM_NEVER;
+	wkt_count_seen = 0;
+	adc_source = 0;
+}
+
+int sim_run(int (*entry)(void), uint64_t until_us)
+{
+	// entry() normally never returns: __WFI() leaves through exit_jmp
+	int reason;
+
+	until_ns = until_us * 1000U;
+	reason = setjmp(exit_jmp);
+	if (reason == 0) {
+		entry();
+		reason = SIM_EXIT_RETURNED;
+	}
+	in_handler = 0;
+	mmio_trace_stop();
+	return reason;
+}
+
+uint64_t sim_now_us(void)
+{
+	return now_ns / 1000U;
+}
+
+int sim_at(uint64_t t_us, void (*action)(void))
+{
+	uint64_t t_ns = t_us * 1000U;
+	uint32_t i = action_count;
+
+	if (action_count == SIM_MAX_ACTIONS) {
+		return 0;
+	}
+	while ((i > 0) && (actions[i - 1].t_ns > t_ns)) {
+		actions[i] = actions[i - 1];
+		i--;
+	}
+	actions[i].t_ns = t_ns;
+	actions[i].action = action;
+	action_count++;
+	return 1;
+}
+
+void sim_press_button(void)
+{
+	// Falling edge on the pin selected for PINT channel 0
+	int edge;
+
+	mmio_sim_begin();
+	sync_pint();
+	edge = ((PINT->ISEL & 1U) == 0) && (PINT->IENF & 1U);
+	if (edge) {
+		PINT->FALL |= 1U;
+		PINT->IST |= 1U;
+		pend(PIN_INT0_IRQn);
+	}
+	mmio_sim_end();
+	dispatch();
+}
+
+void sim_adc_set_source(uint16_t (*source)(uint64_t t_us))
+{
+	adc_source = source;
+}
+
+void sim_adc_inject(uint16_t sample)
+{
+	// A conversion outside the hardware trigger, like a software START
+	mmio_sim_begin();
+	adc_convert(sample);
+	mmio_sim_end();
+	dispatch();
+}
+
+void sim_fire_irq(IRQn_Type irqn)
+{
+	pend(irqn);
+	dispatch();
+}
+
+void sim_disable_irq(void)
+{
+	primask = 1;
+}
+
+void sim_enable_irq(void)
+{
+	primask = 0;
+	dispatch();
+}
+
+uint32_t sim_get_primask(void)
+{
+	return primask;
+}
+
+void sim_set_primask(uint32_t value)
+{
+	primask = value & 1U;
+	dispatch();
+}
+
+void sim_wfi(void)
+{
+	// Advance simulated time until an enabled IRQ is pending. With PRIMASK
+	// set it stays pending and runs once the firmware unmasks.
+	uint32_t pm;
+	int deep;
+	uint64_t start = now_ns;
+
+	mmio_sim_begin();	// ended by the longjmp() out of sim_run() too
+	pm = PMU->PCON & PMU_PCON_PM_MASK;
+	deep = (SCB->SCR & SCB_SCR_SLEEPDEEP_Msk) != 0;
+	if (deep && (pm == kPmu_Deep_PowerDown)) {
+		longjmp(exit_jmp, SIM_EXIT_DEEP_POWER_DOWN);
+	}
+	if (deep) {
+		sim_stats.wfi_power_down++;
+	} else {
+		sim_stats.wfi_sleep++;
+	}
+	sync_registers();
+	while ((nvic_pending & nvic_enabled) == 0) {
+		uint64_t next = next_event(deep);
+
+		if (next > until_ns) {
+			next = until_ns;
+		}
+		if (deep) {
+			sim_stats.power_down_ns += next - now_ns;
+		} else {
+			sim_stats.sleep_ns += next - now_ns;
+		}
+		now_ns = next;
+		if (now_ns == until_ns) {
+			longjmp(exit_jmp, SIM_EXIT_TIME_UP);
+		}
+		run_events(deep);
+		sync_registers();
+	}
+	if (deep) {
+		// The system clock was stopped: nothing it drives moved meanwhile
+		for (int n = 0; n < SIM_MRT_CHANNELS; n++) {
+			if (mrt_expiry[n] != SIM_NEVER) {
+				mrt_expiry[n] += now_ns - start;
+			}
+		}
+		if (ctimer_next != SIM_NEVER) {
+			ctimer_next += now_ns - start;
+		}
+	}
+	mmio_sim_end();
+}
+
+void sim_nvic_enable(int32_t irqn)
+{
+	nvic_enabled |= (1UL<<irqn);
+	dispatch();
+}
+
+void sim_nvic_disable(int32_t irqn)
+{
+	nvic_enabled &= ~(1UL<<irqn);
+}
+
+uint32_t sim_nvic_is_enabled(int32_t irqn)
+{
+	return (nvic_enabled >> irqn) & 1U;
+}
+
+void sim_nvic_set_pending(int32_t irqn)
+{
+	pend(irqn);
+	dispatch();
+}
+
+void sim_nvic_clear_pending(int32_t irqn)
+{
+	nvic_pending &= ~(1UL<<irqn);
+}
+
+uint32_t sim_nvic_is_pending(int32_t irqn)
+{
+	return (nvic_pending >> irqn) & 1U;
+}
+
+void sim_system_reset(void)
+{
+	longjmp(exit_jmp, SIM_EXIT_RESET);
+}
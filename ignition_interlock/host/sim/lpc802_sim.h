@@ -0,0 +1,48 @@
+/**
+ * @file    lpc802_sim.h
+ * @brief   RAM-backed LPC802 for running the firmware on the host.
+ *
+ * sim_init() maps plain memory at the real peripheral addresses, so the
+ * firmware and the SDK drivers compile and run unchanged. Time only moves
+ * while the firmware waits in __WFI(); the MRT, CTIMER0 (ADC trigger), ADC
+ * sequence A / threshold compare, PINT channel 0 and the WKT are modelled
+ * from what the firmware wrote to their registers.
+ */
+
+#ifndef LPC802_SIM_H_
+#define LPC802_SIM_H_
+
+#include <stdint.h>
+#include "LPC802.h"
+
+#define SIM_EXIT_TIME_UP (1) // sim_run() reached its end time in __WFI()
+#define SIM_EXIT_DEEP_POWER_DOWN (2) // The firmware entered deep power-down
+#define SIM_EXIT_RESET (3) // NVIC_SystemReset()
+#define SIM_EXIT_RETURNED (4) // The firmware's main() returned
+
+#define SIM_MAX_ACTIONS (32) // Pending sim_at() callbacks
+#define SIM_IRQ_COUNT (32)
+
+typedef struct {
+	uint32_t irqs[SIM_IRQ_COUNT];	// Handler runs per IRQ number
+	uint32_t wfi_sleep;	// __WFI() in sleep mode
+	uint32_t wfi_power_down;	// __WFI() in deep-sleep or power-down
+	uint64_t sleep_ns;	// Simulated time spent in each mode
+	uint64_t power_down_ns;
+	uint32_t adc_conversions;
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+void sim_init(void);
+int sim_run(int (*entry)(void), uint64_t until_us);
+uint64_t sim_now_us(void);
+
+// Stimulus hooks, safe to call from sim_at() callbacks
+int sim_at(uint64_t t_us, void (*action)(void));
+void sim_press_button(void);
+void sim_adc_set_source(uint16_t (*source)(uint64_t t_us));
+void sim_adc_inject(uint16_t sample);
+void sim_fire_irq(IRQn_Type irqn);
+
+#endif /* LPC802_SIM_H_ */
@@ -0,0 +1,352 @@
+/**
+ * @file    mmio_trace.c
+ * @brief   Per-peripheral and per-function register access counts.
+ *
+ * Counts are taken from an -O0 build of the firmware, where every C-level
+ * register read and write is its own load or store, as on the M0+.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include "mmio_trace.h"
+#include "LPC802.h"
+
+#define PAGE_SIZE (4096UL)
+#define EFLAGS_TF (0x100) // x86 trap flag: fault after one instruction
+#define MAX_FUNCS (256) // Must be a power of 2
+#define MAX_DEPTH (64)
+#define PERIPH_OTHER (0)
+
+typedef struct {
+	uintptr_t base;
+	size_t size;
+	const char *name;
+} mmio_range_t;
+
+typedef struct {
+	void *fn;
+	uint32_t calls;
+	uint32_t self_reads;
+	uint32_t self_writes;
+	uint32_t incl_reads;
+	uint32_t incl_writes;
+	uint64_t delay_cycles;	// Blocking MRT delays, callees included
+	uint32_t mark;	// Last access counted inclusively, stops double counting
+	uint32_t reads[32];	// Self accesses per mmio_periphs[] entry
+	uint32_t writes[32];
+} func_stats_t;
+
+// The peripheral part of the simulator's register map
+static const mmio_range_t mmio_protect[] = {
+	{0x40000000u, 0x70000u, 0},
+	{0x50000000u, 0x1000u, 0},
+	{0xA0000000u, 0x8000u, 0},
+	{SCS_BASE, 0x1000u, 0},
+};
+
+static const mmio_range_t mmio_periphs[] = {
+	[PERIPH_OTHER] = {0, 0, "other"},
+	{WWDT_BASE, 0x4000u, "WWDT"},
+	{MRT0_BASE, 0x4000u, "MRT0"},
+	{WKT_BASE, 0x4000u, "WKT"},
+	{SWM0_BASE, 0x4000u, "SWM0"},
+	{ADC0_BASE, 0x4000u, "ADC0"},
+	{PMU_BASE, 0x4000u, "PMU"},
+	{ACOMP_BASE, 0x4000u, "ACOMP"},
+	{CTIMER0_BASE, 0x4000u, "CTIMER0"},
+	{IOCON_BASE, 0x4000u, "IOCON"},
+	{SYSCON_BASE, 0x4000u, "SYSCON"},
+	{I2C0_BASE, 0x4000u, "I2C0"},
+	{SPI0_BASE, 0x4000u, "SPI0"},
+	{USART0_BASE, 0x4000u, "USART0"},
+	{USART1_BASE, 0x4000u, "USART1"},
+	{CRC_BASE, 0x1000u, "CRC"},
+	{GPIO_BASE, 0x4000u, "GPIO"},
+	{PINT_BASE, 0x1000u, "PINT"},
+	{SysTick_BASE, 0x10u, "SysTick"},
+	{SCB_BASE, 0x100u, "SCB"},
+};
+
+#define PERIPH_COUNT (sizeof(mmio_periphs) / sizeof(mmio_periphs[0]))
+
+static int tracing = 0;
+static int sim_depth = 0;
+static uintptr_t open_page = 0;	// Opened for the instruction being stepped
+static uintptr_t open_addr;
+static int open_write;
+
+static uint32_t periph_reads[PERIPH_COUNT];
+static uint32_t periph_writes[PERIPH_COUNT];
+static func_stats_t funcs[MAX_FUNCS];
+static uint32_t func_count = 0;
+static func_stats_t *stack[MAX_DEPTH];
+static uint32_t depth = 0;
+static uint32_t irq_base = 0;	// Inclusive counts stop at the interrupted code
+static uint32_t access_mark = 0;
+
+void __cyg_profile_func_enter(void *fn, void *site) __attribute__((no_instrument_function));
+void __cyg_profile_func_exit(void *fn, void *site) __attribute__((no_instrument_function));
+
+static void protect(int prot)
+{
+	for (size_t i = 0; i < (sizeof(mmio_protect) / sizeof(mmio_protect[0])); i++) {
+		mprotect((void *)mmio_protect[i].base, mmio_protect[i].size, prot);
+	}
+}
+
+static int is_protected(uintptr_t addr)
+{
+	for (size_t i = 0; i < (sizeof(mmio_protect) / sizeof(mmio_protect[0])); i++) {
+		if ((addr >= mmio_protect[i].base) && (addr < (mmio_protect[i].base + mmio_protect[i].size))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static uint32_t periph_of(uintptr_t addr)
+{
+	for (uint32_t i = 1; i < PERIPH_COUNT; i++) {
+		if ((addr >= mmio_periphs[i].base) && (addr < (mmio_periphs[i].base + mmio_periphs[i].size))) {
+			return i;
+		}
+	}
+	return PERIPH_OTHER;
+}
+
+static func_stats_t *func_of(void *fn)
+{
+	uint32_t i = (uint32_t)(((uintptr_t)fn >> 4) & (MAX_FUNCS - 1));
+
+	while (funcs[i].fn != fn) {
+		if (funcs[i].fn == 0) {
+			if (func_count == (MAX_FUNCS - 1)) {
+				return 0;	// full: left out of the per-function table
+			}
+			funcs[i].fn = fn;
+			func_count++;
+			break;
+		}
+		i = (i + 1) & (MAX_FUNCS - 1);
+	}
+	return &funcs[i];
+}
+
+void __cyg_profile_func_enter(void *fn, void *site)
+{
+	func_stats_t *f = func_of(fn);
+
+	(void)site;
+	if (f) {
+		f->calls++;
+	}
+	if (depth < MAX_DEPTH) {
+		stack[depth] = f;
+	}
+	depth++;
+}
+
+void __cyg_profile_func_exit(void *fn, void *site)
+{
+	(void)fn;
+	(void)site;
+	if (depth > 0) {
+		depth--;
+	}
+}
+
+static void count(uintptr_t addr, int write, uint64_t delay)
+{
+	uint32_t p = periph_of(addr);
+	uint32_t top = (depth < MAX_DEPTH) ? depth : MAX_DEPTH;
+
+	if (delay == 0) {
+		if (write) {
+			periph_writes[p]++;
+		} else {
+			periph_reads[p]++;
+		}
+	}
+	access_mark++;
+	for (uint32_t i = top; i > irq_base; i--) {
+		func_stats_t *f = stack[i - 1];
+
+		if ((f == 0) || (f->mark == access_mark)) {
+			continue;	// recursion: count each function once
+		}
+		f->mark = access_mark;
+		if (delay != 0) {
+			f->delay_cycles += delay;
+		} else if (write) {
+			f->incl_writes++;
+			if (i == top) {
+				f->self_writes++;
+				f->writes[p]++;
+			}
+		} else {
+			f->incl_reads++;
+			if (i == top) {
+				f->self_reads++;
+				f->reads[p]++;
+			}
+		}
+	}
+}
+
+static void on_segv(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+	uintptr_t addr = (uintptr_t)info->si_addr;
+
+	(void)sig;
+	if (!tracing || (sim_depth != 0) || !is_protected(addr) || (open_page != 0)) {
+		signal(SIGSEGV, SIG_DFL);	// a real fault: let it happen again
+		return;
+	}
+	open_addr = addr;
+	open_write = (uc->uc_mcontext.gregs[REG_ERR] & 0x2) != 0;
+	open_page = addr & ~(PAGE_SIZE - 1);
+	count(addr, open_write, 0);
+	mprotect((void *)open_page, PAGE_SIZE, PROT_READ | PROT_WRITE);
+	uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+}
+
+static void on_trap(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+
+	(void)sig;
+	(void)info;
+	if (open_page == 0) {
+		return;
+	}
+	// A LOAD on an MRT channel without INTEN is a blocking delay_us()
+	if (open_write && (open_addr >= MRT0_BASE) && (open_addr < (uintptr_t)&MRT0->CHANNEL[2])
+			&& (((open_addr - MRT0_BASE) & 0xF) == 0)) {
+		uint32_t chan = (uint32_t)((open_addr - MRT0_BASE) >> 4);
+		uint32_t intval = MRT0->CHANNEL[chan].INTVAL;
+
+		if ((intval & MRT_CHANNEL_INTVAL_LOAD_MASK) && !(MRT0->CHANNEL[chan].CTRL & MRT_CHANNEL_CTRL_INTEN_MASK)) {
+			count(open_addr, 1, intval & MRT_CHANNEL_INTVAL_IVALUE_MASK);
+		}
+	}
+	mprotect((void *)open_page, PAGE_SIZE, PROT_NONE);
+	open_page = 0;
+	uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+}
+
+void mmio_trace_start(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sa.sa_sigaction = on_segv;
+	sigaction(SIGSEGV, &sa, 0);
+	sa.sa_sigaction = on_trap;
+	sigaction(SIGTRAP, &sa, 0);
+
+	memset(periph_reads, 0, sizeof(periph_reads));
+	memset(periph_writes, 0, sizeof(periph_writes));
+	memset(funcs, 0, sizeof(funcs));
+	func_count = 0;
+	depth = 0;
+	irq_base = 0;
+	sim_depth = 0;
+	tracing = 1;
+	protect(PROT_NONE);
+}
+
+void mmio_trace_stop(void)
+{
+	if (tracing) {
+		tracing = 0;
+		sim_depth = 0;
+		depth = 0;
+		irq_base = 0;
+		protect(PROT_READ | PROT_WRITE);
+	}
+}
+
+void mmio_sim_begin(void)
+{
+	if (tracing && (sim_depth++ == 0)) {
+		protect(PROT_READ | PROT_WRITE);
+	}
+}
+
+void mmio_sim_end(void)
+{
+	if (tracing && (--sim_depth == 0)) {
+		protect(PROT_NONE);
+	}
+}
+
+uint32_t mmio_irq_begin(void)
+{
+	uint32_t saved = irq_base;
+
+	irq_base = depth;
+	return saved;
+}
+
+void mmio_irq_end(uint32_t saved)
+{
+	irq_base = saved;
+}
+
+static int by_name(const void *a, const void *b)
+{
+	return strcmp(((const char *const *)a)[0], ((const char *const *)b)[0]);
+}
+
+void mmio_trace_report(FILE *out)
+{
+	struct {
+		const char *name;
+		func_stats_t *f;
+	} rows[MAX_FUNCS];
+	uint32_t n = 0;
+
+	fprintf(out, "%-12s %10s %10s\n", "peripheral", "reads", "writes");
+	for (uint32_t p = 0; p < PERIPH_COUNT; p++) {
+		if (periph_reads[p] || periph_writes[p]) {
+			fprintf(out, "%-12s %10u %10u\n", mmio_periphs[p].name, periph_reads[p], periph_writes[p]);
+		}
+	}
+
+	for (uint32_t i = 0; i < MAX_FUNCS; i++) {
+		Dl_info dl;
+
+		if (funcs[i].fn == 0) {
+			continue;
+		}
+		rows[n].name = (dladdr(funcs[i].fn, &dl) && dl.dli_sname) ? dl.dli_sname : "?";
+		rows[n].f = &funcs[i];
+		n++;
+	}
+	qsort(rows, n, sizeof(rows[0]), by_name);
+
+	fprintf(out, "\n%-24s %8s %8s %8s %8s %8s %12s  %s\n", "function", "calls",
+			"self_r", "self_w", "incl_r", "incl_w", "delay_cyc", "self by peripheral");
+	for (uint32_t i = 0; i < n; i++) {
+		func_stats_t *f = rows[i].f;
+
+		fprintf(out, "%-24s %8u %8u %8u %8u %8u %12llu ", rows[i].name, f->calls,
+				f->self_reads, f->self_writes, f->incl_reads, f->incl_writes,
+				(unsigned long long)f->delay_cycles);
+		for (uint32_t p = 0; p < PERIPH_COUNT; p++) {
+			if (f->reads[p] || f->writes[p]) {
+				fprintf(out, " %s %ur/%uw", mmio_periphs[p].name, f->reads[p], f->writes[p]);
+			}
+		}
+		fprintf(out, "\n");
+	}
+}
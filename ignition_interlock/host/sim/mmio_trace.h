@@ -0,0 +1,30 @@
+/**
+ * @file    mmio_trace.h
+ * @brief   Per-peripheral and per-function register access counts.
+ *
+ * While tracing, the register pages are inaccessible to the firmware: every
+ * access faults once, is counted against the peripheral and the innermost
+ * firmware function (-finstrument-functions), then single-steps with the
+ * page opened. Blocking MRT delays (a LOAD on a channel without INTEN) are
+ * counted as delay cycles. x86-64 Linux only.
+ */
+
+#ifndef MMIO_TRACE_H_
+#define MMIO_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+void mmio_trace_start(void);
+void mmio_trace_stop(void);
+void mmio_trace_report(FILE *out);
+
+// Bracket simulator code that touches registers, so it is not counted
+void mmio_sim_begin(void);
+void mmio_sim_end(void);
+
+// Bracket an interrupt handler; returns the value mmio_irq_end() restores
+uint32_t mmio_irq_begin(void);
+void mmio_irq_end(uint32_t saved);
+
+#endif /* MMIO_TRACE_H_ */
@@ -6,6 +6,12 @@
 
 #include "LPC802.h"
 #include "clock_config.h"
+#include "fsl_power.h"
+#include "fsl_reset.h"
+#if defined(SDK_DEBUGCONSOLE) && (SDK_DEBUGCONSOLE != 0)
+#include "board.h"
+#include "fsl_usart.h"
+#endif
 #include <stdio.h>
 
 #define RS (4)
@@ -21,7 +27,39 @@
 #define D6 (0)
 #define D7 (8)
 
+#define LCD_DATA_MASK ((1UL<<D0) | (1UL<<D1) | (1UL<<D2) | (1UL<<D3) \
+		| (1UL<<D4) | (1UL<<D5) | (1UL<<D6) | (1UL<<D7))
+#define LCD_CMD_CLEAR (0x01) // Clear display, cursor home (1.52 ms)
+#define LCD_CMD_DISPLAY_ON (0x0C) // Display on, cursor and blink off
+#define LCD_CMD_CURSOR_RIGHT (0x14) // Shift the cursor one cell right
+#define LCD_CMD_FUNCTION_2LINE (0x38) // 8-bit bus, 2 lines, 5x8 font
+#define LCD_CMD_LINE2 (0xC0) // DDRAM address 0x40: start of the 2nd line
+#define LCD_CMD_SET_DDRAM (0x80) // OR'ed with the DDRAM address
+#define LCD_ROWS (2)
+#define LCD_COLS (16)
+#define LCD_ROW_STRIDE (0x40) // DDRAM address of the 2nd line
+#define LCD_EN_PULSE_NOPS (8) // Keeps EN high for the HD44780's minimum pulse width
+#define LCD_USE_BUSY_FLAG (1) // 1: poll BF on D7 over RW, 0: fixed datasheet waits
+#define LCD_BUSY_POLL_LIMIT (2000) // Give up on a stuck/absent panel after this many reads
+#define LCD_POWER_ON_US (40000) // Vcc rise to first command
+#define LCD_CMD_US (37) // Execution time of every command but clear/home
+#define LCD_CLEAR_US (1520) // Execution time of clear display
+#if LCD_USE_BUSY_FLAG
+#define LCD_REFRESH_US (20) // Refresh period, busy ticks are skipped
+#else
+#define LCD_REFRESH_US (LCD_CMD_US + 3) // Refresh period, one bus write each
+#endif
+
+// Byte -> PIO0 pins for D0-D7, expanded by the preprocessor into lcd_pins[]
+#define LCD_PINS(b) ((uint16_t)((((b)>>0)&1UL)<<D0 | (((b)>>1)&1UL)<<D1 \
+		| (((b)>>2)&1UL)<<D2 | (((b)>>3)&1UL)<<D3 | (((b)>>4)&1UL)<<D4 \
+		| (((b)>>5)&1UL)<<D5 | (((b)>>6)&1UL)<<D6 | (((b)>>7)&1UL)<<D7))
+#define LCD_PINS4(b) LCD_PINS(b), LCD_PINS((b)+1), LCD_PINS((b)+2), LCD_PINS((b)+3)
+#define LCD_PINS16(b) LCD_PINS4(b), LCD_PINS4((b)+4), LCD_PINS4((b)+8), LCD_PINS4((b)+12)
+#define LCD_PINS64(b) LCD_PINS16(b), LCD_PINS16((b)+16), LCD_PINS16((b)+32), LCD_PINS16((b)+48)
+
 #define BUTTON (12)
+#define BUTTON_DEBOUNCE_MS (30) // PINT0 stays masked after a press until the panel shows it and this long after
 #define LED_HEADLIGHTS	(15)
 
 #define MRT_REPEAT (0) // Repeat mode for MRT
@@ -29,233 +67,1264 @@
 #define MRT_GFLAG0 (0) // IRQ Flag 0 (channel 0)
 #define MRT_GFLAG1 (1) // IRQ Flag 1 (channel 1)
 #define MRT_CHAN0 (0) // channel 0 on MRT
+#define MRT_CHAN_DELAY (MRT_CHAN0) // One-shot delay service
 #define MRT_CHAN1 (1) // channel 1 on MRT
-#define LED_PERIOD_TICKS (30000) // Pulses not visible to human eye.
-#define INIT_COUNT_IRQ_CH0 (LED_PERIOD_TICKS/2)
-#define INIT_COUNT_IRQ_CH1 (120000000)
-#define INIT_PWM_DUTY_FACTOR 0.2
+#define BAC_RESULT_DELAY_MS (8000) // Press to BAC result if no breath end is seen (was 120M ticks at 15 MHz)
+#define INIT_PWM_DUTY_PERCENT (20) // Headlight brightness while the car may run
+#define MEASURE_PRESS_LATENCY (0) // 1: SysTick stamps press-to-armed in press_latency_cycles
+#define MEASURE_ADC_COST (0) // 1: SysTick cycles of the SEQA ISR per decimated sample in adc_output_cycles
+
+#define CLOCK_PHASE_LOW (0) // FRO 18 MHz: idle, sensor warm-up and sampling
+#define CLOCK_PHASE_BURST (1) // FRO 30 MHz: for a hot spot axf_bench shows is worth it; none is yet
+
+#define EVENT_QUEUE_SIZE (8) // Must be a power of 2
+#define EVT_BUTTON_PRESS (1) // PIN_INT0: falling edge on BUTTON
+#define EVT_BAC_TIMER (2) // MRT channel 1: time to show the BAC result
+#define EVT_IDLE_TIMEOUT (3) // WKT: nobody used the device for INACTIVITY_TIMEOUT_S
+#define EVT_BREATH_END (4) // ADC SEQA: the breath detector has its plateau
+
+#define DPD_ENABLE (0) // 1: deep power-down after INACTIVITY_TIMEOUT_S (needs the wiring below)
+#define INACTIVITY_TIMEOUT_S (60) // Idle time before deep power-down
+#define LPOSC_HZ (10000) // Nominal WKT clock in every power mode
+// Only the WAKEUP pin, PIO0_4, ends deep power-down, and this board has the
+// LCD RS line there. DPD_ENABLE needs BUTTON rewired to PIO0_4 and RS moved
+// to a free pin; without it the device idles in power-down, where PINT0
+// wakes it on BUTTON.
+#define DPD_WAKEUP_PIO (4)
+#define DPD_WAKEUP_PIN (kPmu_Dpd_En_Pio0_4)
+#define RETAIN_MAGIC (0xB7E00000UL) // Marks GPREG0 as holding valid session state
+#define RETAIN_MAGIC_MASK (0xFFF00000UL)
+#define RETAIN_READINGS_MASK (0xFFUL)
+
+#define ADC_CHANNEL (2) // Alcohol sensor on ADC_2 (PIO0_14)
+#define ADC_TRIG_T0_MAT3 (5) // SEQA hardware trigger input: CTIMER0 match 3
+#define ADC_SAMPLE_RATE_HZ (100) // Sensor samples per second, after decimation
+#define ADC_OVERSAMPLE_BITS (2) // Extra bits per sample from summing 4^n conversions: 0 (off) to 4
+#define ADC_OVERSAMPLE_COUNT (1UL<<(2 * ADC_OVERSAMPLE_BITS))
+#define ADC_CONVERSION_RATE_HZ (ADC_SAMPLE_RATE_HZ * ADC_OVERSAMPLE_COUNT) // CTIMER0 pacing while capturing
+#define ADC_RESULT_BITS (12 + ADC_OVERSAMPLE_BITS) // Width of a sample, the ring and adc_avg
+#define AVG_WINDOW_SHIFT (6) // Averaging window of 2^n samples, n from 4 (the ring holds BREATH_SLOPE_SPAN) to 8
+#define AVG_WINDOW (1UL<<AVG_WINDOW_SHIFT)
+#define ADC_RING_SIZE (AVG_WINDOW) // Samples kept: the window, which also covers BREATH_SLOPE_SPAN
+#define ADC_MAX (0xFFF) // Full scale of a 12-bit conversion
+#define SAMPLE_MAX ((1UL<<ADC_RESULT_BITS) - 1) // Full scale of a decimated sample
+#define CTIMER_MAT0 (0) // Match channel driving the headlight PWM
+#define CTIMER_MAT3 (3) // Match channel pacing the ADC
+
+#define ADC_IDLE_RATE_HZ (10) // Sensor samples per second while waiting for a breath
+#define BREATH_THRESHOLD_MARGIN (60) // Conversion counts away from the idle baseline that count as a breath
+#define BAC_ADC_FLOOR (2050) // vMin: sensor output in clean air, in conversion counts
+#define BAC_SCALE_NUM (16716) // BAC per conversion count over the floor: 16716 / 409, see BAC_FromAdc()
+#define BAC_SCALE_DEN (409UL)
+#define BAC_LIMIT (8999) // Highest BAC that starts the car (0.08 %), in 0.00001 %
+#define BAC_NO_BREATH (-1) // bac when no breath was read: neither a pass nor a failed reading
+// Lowest sample BAC_FromAdc() puts over BAC_LIMIT, past SAMPLE_MAX if none does
+#define BAC_LIMIT_SAMPLE_RAW (((uint32_t)BAC_ADC_FLOOR << ADC_OVERSAMPLE_BITS) \
+		+ ((((BAC_LIMIT + 1ULL) * (BAC_SCALE_DEN << ADC_OVERSAMPLE_BITS)) + BAC_SCALE_NUM - 1) / BAC_SCALE_NUM))
+#define BAC_LIMIT_SAMPLE ((BAC_LIMIT_SAMPLE_RAW > SAMPLE_MAX) ? (SAMPLE_MAX + 1) : BAC_LIMIT_SAMPLE_RAW)
+#define ADC_MODE_BASELINE (0) // Full rate, averaging the idle sensor level
+#define ADC_MODE_WATCH (1) // Idle rate, threshold compare only (no SEQA IRQs)
+#define ADC_MODE_CAPTURE (2) // Full rate, every sample goes to the averager
+#define ADC_MODE_HOLD (3) // Breath result taken: no triggers, CTIMER0 runs on for the headlights only
+
+// Breath detector on the filtered samples while capturing, see BREATH_Update()
+#define BREATH_SLOPE_SPAN (10) // Samples the slope is taken over (100 ms)
+#define BREATH_FLAT_SHIFT (5) // Plateau while the slope stays within amplitude / 2^n per span
+#define BREATH_DECAY_SHIFT (3) // Plateau over once the level is amplitude / 2^n below its peak
+#define BREATH_PLATEAU_MIN (20) // Samples: a shorter plateau is not a breath
+#define BREATH_PLATEAU_MAX (200) // Samples: result after this much plateau, still blowing or not
+#define BREATH_BLOCK (10) // Plateau samples per block mean (100 ms): the result is the highest one
+#define BREATH_WAIT (0) // breath_state: below the onset level
+#define BREATH_RISE (1) // Above it, level still moving
+#define BREATH_PLATEAU (2) // Level flat: samples summed for the result
+#define BREATH_DONE (3) // Result posted
+
+// Early decision on the plateau, see BAC_Estimate()
+// Off until the estimator is checked against recorded breaths. It assumes a
+// first-order sensor within SENSOR_TAU_MIN_MS to SENSOR_TAU_MAX_MS; with a
+// sensor outside that range host/breath_replay sees it decide wrongly.
+#define BAC_EARLY_DECISION (0) // 1: end the plateau once BAC_LIMIT is outside the confidence band
+#define SENSOR_TAU_MS (300) // First-order time constant assumed for the sensor response
+#define SENSOR_TAU_MIN_MS (150) // ... and the range it may take between sensors and over their life
+#define SENSOR_TAU_MAX_MS (600)
+#define BAC_EST_BLOCK (10) // Plateau samples per block mean, one fitted level each
+#define BAC_EST_BLOCK_MS ((BAC_EST_BLOCK * 1000) / ADC_SAMPLE_RATE_HZ)
+// Rise still to come per block step, r / (1 - r) with r = e^(-block / tau),
+// in Q8 by its series tau / block - 1/2 + block / (12 tau)
+#define BAC_EST_TAIL_Q8(tau) ((((tau) * 256) / BAC_EST_BLOCK_MS) - 128 + ((BAC_EST_BLOCK_MS * 256) / (12 * (tau))))
+#define BAC_EST_MIN_LEVELS (4) // Fitted levels before the first decision (0.5 s of plateau)
+#define BAC_EST_K (3) // Band half-width in standard errors of the mean level
+#define BAC_EST_Q (4) // Fraction bits of block means and fitted levels
+
+// Filter stage between the ADC result and the averaging ring, integer only
+#define FILTER_MEDIAN_TAPS (5) // Sliding median over the last n raw samples: 1 (off), 3, 5 or 7
+#define FILTER_IIR_ORDER (2) // Low-pass after the median: 0 (off), 1 or 2
+#define FILTER_EMA_SHIFT (3) // 1st order: y += (x - y) / 2^n, cutoff about fs / (2 pi 2^n)
+#define FILTER_EMA_Q (15 - ADC_OVERSAMPLE_BITS) // 1st order state: samples in Q15 of a 12-bit conversion
+// 2nd order state: samples in Q3 of a 12-bit conversion, headroom for the Q14
+// products. From 15 bits up, Q0: a1 * y still fits 31 bits with overshoot.
+#define FILTER_SAMPLE_Q ((ADC_OVERSAMPLE_BITS < 3) ? (3 - ADC_OVERSAMPLE_BITS) : 0)
+#define FILTER_COEF_Q (14) // Fraction bits of the biquad coefficients
+#define FILTER_CUTOFF_HZ (5) // 2nd order, at ADC_SAMPLE_RATE_HZ: the design of the coefficients below
+// Butterworth (butter(2, 0.1)): b = {0.020083, 0.040167, 0.020083},
+// a = {1, -1.561018, 0.641352}, in Q14. Rounded so that b0 + b1 + b2 =
+// 1 + a1 + a2 exactly: unity gain at DC.
+#define FILTER_B0 (329)
+#define FILTER_B1 (658)
+#define FILTER_B2 (329)
+#define FILTER_A1 (-25576)
+#define FILTER_A2 (10508)
+#define FILTER_STAGE_MEDIAN (1UL<<0) // filter_primed bits
+#define FILTER_STAGE_IIR (1UL<<1)
+
+#define PERIPH_GPIO0 (0) // Button and LCD bus, held for the whole run
+#define PERIPH_GPIO_INT (1) // Button pin interrupt, held for the whole run
+#define PERIPH_MRT (2) // Held by the LCD refresh task and by a session
+#define PERIPH_CTIMER0 (3) // ADC pacing and headlight PWM, held by a session
+#define PERIPH_ADC (4) // Held by a session
+#define PERIPH_SWM (5) // Only while pin assignments change; they persist gated
+#define PERIPH_WKT (6) // Inactivity timeout, held while it counts
+#define PERIPH_COUNT (7)
+
+#if (AVG_WINDOW_SHIFT < 4) || (AVG_WINDOW_SHIFT > 8)
+#error "AVG_WINDOW_SHIFT must be 4 to 8: windows of 16 to 256 samples, the ring holding BREATH_SLOPE_SPAN"
+#endif
+#if (ADC_OVERSAMPLE_BITS < 0) || (ADC_OVERSAMPLE_BITS > 4)
+#error "ADC_OVERSAMPLE_BITS must be 0 to 4: samples, the ring and the filter taps are 16 bits"
+#endif
+#if (BREATH_SLOPE_SPAN >= ADC_RING_SIZE) || (BREATH_BLOCK > BREATH_PLATEAU_MIN) || (((BREATH_PLATEAU_MAX * (SAMPLE_MAX + 1)) << BAC_EST_Q) > 0xFFFFFFFF)
+#error "BREATH_SLOPE_SPAN must fit the ring, BREATH_BLOCK a shortest plateau and BREATH_PLATEAU_MAX samples a 32-bit sum in BAC_EST_Q"
+#endif
+#if (SENSOR_TAU_MIN_MS < BAC_EST_BLOCK_MS) || (SENSOR_TAU_MIN_MS > SENSOR_TAU_MS) || (SENSOR_TAU_MS > SENSOR_TAU_MAX_MS) \
+		|| (((BAC_EST_MIN_LEVELS + 1) * BAC_EST_BLOCK) >= BREATH_PLATEAU_MAX)
+#error "BAC_EST_BLOCK must be shorter than SENSOR_TAU_MIN_MS, SENSOR_TAU_MS within its range, and BAC_EST_MIN_LEVELS fit a plateau"
+#endif
+#if DPD_ENABLE && ((BUTTON != DPD_WAKEUP_PIO) || (RS == DPD_WAKEUP_PIO))
+#error "DPD_ENABLE: wire BUTTON to PIO0_4, the only deep power-down wake pin, and move RS off it"
+#endif
+#if ((FILTER_MEDIAN_TAPS & 1) == 0) || (FILTER_MEDIAN_TAPS > 7)
+#error "FILTER_MEDIAN_TAPS must be 1, 3, 5 or 7"
+#endif
+
+// Single-producer/single-consumer ring: the ISR only moves head, main() only
+// moves tail. Byte-sized indices make every access a single load or store, so
+// no LDREX/STREX (absent on the M0+) or interrupt masking is needed.
+typedef struct {
+	uint8_t volatile head;
+	uint8_t volatile tail;
+	uint8_t volatile events[EVENT_QUEUE_SIZE];
+} event_queue_t;
+
+// What to switch on for the first user of a peripheral and off for the last
+typedef struct {
+	uint32_t ahb_clock;	// SYSAHBCLKCTRL0 bit
+	uint32_t power;	// PDRUNCFG bit of its analog block, 0 if none
+	reset_ip_name_t reset;	// kOTHER_RST_N_SHIFT_RSTn: state must survive
+} periph_gate_t;
 
 //prototypes
-void delay(void);
+int postEvent(event_queue_t *q, uint8_t event);
+int takeEvent(event_queue_t *q, uint8_t *event);
+void PERIPH_Acquire(uint32_t periph);
+void PERIPH_Release(uint32_t periph);
+void handleButtonPress(void);
+void BUTTON_Debounce(void);
+void BUTTON_Rearm(void);
+void armSession(void);
+void endSession(void);
+void enterIdle(void);
+void startIdleTimer(void);
+void stopIdleTimer(void);
+void startBACTimer(void);
+void stopBACTimer(void);
+void enterDeepPowerDown(void);
+int resumeFromDeepPowerDown(void);
+void delay_us(uint32_t us);
+void delay_us_async(uint32_t us, void (*done)(void));
+uint32_t MRT_TicksFromUs(uint32_t us);
 void init_ADC(void);
+void CTIMER_Config(void);
+void MRT_Config(void);
+void init_LCD(int warm);
+void LCD_StartRefresh(void);
+void LCD_Refresh(void);
+void markLCDDirty(void);
+void showBACResult(void);
+int BAC_FromAdc(uint32_t avg);
+void CTIMER_SetSampleRate(uint32_t rate_hz);
+void setClockPhase(uint32_t phase);
+void rescaleMRTChannel(uint32_t chan, uint32_t old_hz, uint32_t new_hz);
+void LED_SetDuty(uint32_t percent);
+void FILTER_Reset(void);
+uint32_t FILTER_Median(uint32_t x);
+uint32_t FILTER_LowPass(uint32_t x);
+void BREATH_Reset(void);
+void BREATH_Update(uint32_t sample);
+uint32_t BREATH_Level(void);
+void BAC_EstimateReset(void);
+int BAC_Estimate(uint32_t sample);
+void ADC_MeasureBaseline(void);
+void ADC_Hold(void);
+void ADC_WatchBreath(uint32_t baseline);
 void moveLCDCursor(void);
 void setLCDNewLine(void);
 void displayON(void);
 void setLCDInitialMsg(void);
 void setLCDFinalMsg(void);
 void setLCDRetryMsg(void);
+void setLCDNoBreathMsg(void);
 void setLCDBACMsg(int bac_val);
 void setLCDBlowMsg(void);
 void setLCDResultMsg(int under_limit);
 void clearLCDDisplay(void);
+void writeLCDByte(uint8_t value, int is_data);
+int isLCDBusy(void);
+void waitLCDReady(void);
 void displayNum(int n);
 void display(char c);
 
+// SET mask for every byte on the LCD bus; the CLR mask is its complement
+// within LCD_DATA_MASK.
+static const uint16_t lcd_pins[256] = {
+	LCD_PINS64(0), LCD_PINS64(64), LCD_PINS64(128), LCD_PINS64(192)
+};
+
+static const periph_gate_t periph_gates[PERIPH_COUNT] = {
+	[PERIPH_GPIO0] = {SYSCON_SYSAHBCLKCTRL0_GPIO0_MASK, 0, kGPIO0_RST_N_SHIFT_RSTn},
+	[PERIPH_GPIO_INT] = {SYSCON_SYSAHBCLKCTRL0_GPIO_INT_MASK, 0, kGPIOINT_RST_N_SHIFT_RSTn},
+	[PERIPH_MRT] = {SYSCON_SYSAHBCLKCTRL0_MRT_MASK, 0, kMRT_RST_N_SHIFT_RSTn},
+	[PERIPH_CTIMER0] = {SYSCON_SYSAHBCLKCTRL0_CTIMER0_MASK, 0, kCTIMER0_RST_N_SHIFT_RSTn},
+	[PERIPH_ADC] = {SYSCON_SYSAHBCLKCTRL0_ADC_MASK, SYSCON_PDRUNCFG_ADC_PD_MASK, kADC_RST_N_SHIFT_RSTn},
+	[PERIPH_SWM] = {SYSCON_SYSAHBCLKCTRL0_SWM_MASK, 0, kOTHER_RST_N_SHIFT_RSTn},
+	[PERIPH_WKT] = {SYSCON_SYSAHBCLKCTRL0_WKT_MASK, SYSCON_PDRUNCFG_LPOSC_PD_MASK, kWKT_RST_N_SHIFT_RSTn},
+};
+
 int volatile bac = 0;
 int bac_checked = 0;
 int lights_on = 0;
+uint32_t led_duty = 0;	// Headlight duty cycle in percent
+uint32_t adc_sample_rate = ADC_CONVERSION_RATE_HZ;	// Current CTIMER0 pacing, conversions per second
+uint32_t clock_phase = CLOCK_PHASE_BURST;	// Forces the first setClockPhase() to apply
 int is_displayed = 0;
 int readings = 0;
-uint32_t volatile adc_result = 0;
+uint32_t volatile adc_result = 0;	// Last conversion, 12 bits
+uint32_t adc_decim_sum = 0;	// Conversions of the sample being decimated
+uint32_t adc_decim_count = 0;
 uint32_t volatile adc_sum;
 uint32_t volatile adc_avg;
-uint32_t volatile adc_buffer[10];
+uint16_t volatile adc_ring[ADC_RING_SIZE];
+uint32_t volatile adc_head = 0;	// Total samples written by the ADC ISR
+uint32_t volatile adc_mode = ADC_MODE_BASELINE;
+uint32_t adc_baseline = 0;	// Idle sensor level the breath threshold is centred on
+uint16_t filter_taps[FILTER_MEDIAN_TAPS];	// Last raw samples, oldest overwritten first
+uint32_t filter_tap = 0;	// Next slot of filter_taps
+int32_t filter_iir[4];	// 1st order: y; 2nd order: x[n-1], x[n-2], y[n-1], y[n-2]
+uint32_t filter_primed = 0;	// FILTER_STAGE_* seeded from their first sample
+uint32_t volatile breath_state = BREATH_WAIT;	// Detector phase, see BREATH_Update()
+uint32_t breath_peak = 0;	// Highest sample since onset
+uint32_t breath_sum = 0;	// Plateau samples so far
+uint32_t breath_count = 0;	// ... and how many (while rising: samples since onset)
+uint32_t breath_block = 0;	// Sum of the current plateau block
+uint32_t breath_block_fill = 0;	// ... and its samples
+uint32_t breath_best = 0;	// Highest block sum of the plateau; 0 before the first
+uint32_t bac_est_fill = 0;	// Samples in the current block
+uint32_t bac_est_block = 0;	// ... and their sum
+int32_t bac_est_prev = 0;	// Mean of the last block, Q BAC_EST_Q
+uint32_t bac_est_count = 0;	// Blocks fitted so far
+int32_t bac_est_fast = 0;	// Sum of the levels fitted at SENSOR_TAU_MIN_MS, Q BAC_EST_Q
+int32_t bac_est_nominal = 0;	// ... at SENSOR_TAU_MS
+int32_t bac_est_slow = 0;	// ... at SENSOR_TAU_MAX_MS
+int32_t bac_est_mean = 0;	// Mean of the slow levels
+int64_t bac_est_m2 = 0;	// Welford sum of their squared deviations from it, Q 2 * BAC_EST_Q
+uint32_t bac_est_level = 0;	// Level decided on early, Q BAC_EST_Q; 0 while undecided
 int press;
-int adc_count;
+int session_active = 0;	// Sampling, PWM or BAC timer running: clocks must stay on
+event_queue_t button_events;	// Posted by PIN_INT0_IRQHandler
+event_queue_t timer_events;	// Posted by MRT0_IRQHandler
+event_queue_t breath_events;	// Posted by ADC0_SEQA_IRQHandler
+event_queue_t wake_events;	// Posted by WKT_IRQHandler
+void (*volatile mrt_delay_done)(void) = 0;	// Callback of the pending async delay
+char volatile lcd_shadow[LCD_ROWS * LCD_COLS];	// What the application wants on screen
+char lcd_panel[LCD_ROWS * LCD_COLS];	// What the refresh task has sent so far
+uint32_t lcd_cursor = 0;	// Next shadow cell written by display()
+uint32_t lcd_addr = 0;	// Panel DDRAM address counter
+int volatile lcd_dirty = 0;	// Shadow and panel may differ
+int volatile button_debounce = 0;	// BUTTON_Rearm() pending, after the refresh task if it runs
+uint8_t periph_refs[PERIPH_COUNT];	// Users of each peripheral, see PERIPH_Acquire()
+uint32_t periph_reset_done = 0;	// Bit per peripheral reset since boot
+#if MEASURE_ADC_COST
+uint32_t adc_cost_cycles = 0;	// SEQA ISR cycles since the last sample
+uint32_t volatile adc_output_cycles;	// ... for the last sample: 4^n conversions
+#endif
+#if MEASURE_PRESS_LATENCY
+uint32_t volatile press_stamp;	// SysTick->VAL in PIN_INT0_IRQHandler
+uint32_t volatile press_latency_cycles;	// Press IRQ to session armed, core clocks
+#endif
+
+int postEvent(event_queue_t *q, uint8_t event) {
+	uint8_t head = q->head;
+
+	if ((uint8_t)(head - q->tail) >= EVENT_QUEUE_SIZE) {
+		return 0;	// full, the event is dropped
+	}
+	q->events[head & (EVENT_QUEUE_SIZE - 1)] = event;
+	q->head = head + 1;	// publish only after the slot is written
+	return 1;
+}
 
-void delay(void){
-	//a simple delay function
-	for (int i=0; i < 10000; i++){
-		asm("NOP");
+int takeEvent(event_queue_t *q, uint8_t *event) {
+	uint8_t tail = q->tail;
+
+	if (tail == q->head) {
+		return 0;
+	}
+	*event = q->events[tail & (EVENT_QUEUE_SIZE - 1)];
+	q->tail = tail + 1;	// hand the slot back only after reading it
+	return 1;
+}
+
+void PERIPH_Acquire(uint32_t periph) {
+	// The first user powers and clocks the block. It is reset only the first
+	// time since boot: registers survive gating, so setup done once stays
+	// valid. Counts change from ISRs too (LCD refresh).
+	const periph_gate_t *gate = &periph_gates[periph];
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	if (periph_refs[periph]++ == 0) {
+		SYSCON->PDRUNCFG &= ~(gate->power);
+		SYSCON->SYSAHBCLKCTRL0 |= gate->ahb_clock;
+		if ((periph_reset_done & (1UL<<periph)) == 0) {
+			RESET_PeripheralReset(gate->reset);
+			periph_reset_done |= (1UL<<periph);
+		}
+	}
+	__set_PRIMASK(primask);
+}
+
+void PERIPH_Release(uint32_t periph) {
+	// The last user gates the clock and powers the analog block down.
+	// Register contents survive gating.
+	const periph_gate_t *gate = &periph_gates[periph];
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	if ((periph_refs[periph] != 0) && (--periph_refs[periph] == 0)) {
+		SYSCON->SYSAHBCLKCTRL0 &= ~(gate->ahb_clock);
+		SYSCON->PDRUNCFG |= gate->power;
+	}
+	__set_PRIMASK(primask);
+}
+
+uint32_t MRT_TicksFromUs(uint32_t us) {
+	// The MRT counts the system clock, whatever profile is active right now
+	uint64_t ticks = ((uint64_t)us * CLOCK_GetCoreSysClkFreq()) / 1000000U;
+
+	if (ticks > MRT_CHANNEL_INTVAL_IVALUE_MASK) {
+		ticks = MRT_CHANNEL_INTVAL_IVALUE_MASK;
+	} else if (ticks == 0) {
+		ticks = 1;	// loading 0 would stop the channel instead
+	}
+	return (uint32_t)ticks;
+}
+
+void delay_us(uint32_t us) {
+	// Blocking wait on the MRT one-shot channel. It shares the channel with
+	// delay_us_async(), so only use it while no async delay is pending.
+	// The caller holds PERIPH_MRT.
+	MRT0->CHANNEL[MRT_CHAN_DELAY].CTRL = (MRT_ONESHOT << MRT_CHANNEL_CTRL_MODE_SHIFT);
+	MRT0->CHANNEL[MRT_CHAN_DELAY].STAT = MRT_CHANNEL_STAT_INTFLAG_MASK;
+	MRT0->CHANNEL[MRT_CHAN_DELAY].INTVAL = MRT_TicksFromUs(us) | (MRT_CHANNEL_INTVAL_LOAD_MASK);
+	while ((MRT0->CHANNEL[MRT_CHAN_DELAY].STAT & MRT_CHANNEL_STAT_INTFLAG_MASK) == 0) {
 	}
+	MRT0->CHANNEL[MRT_CHAN_DELAY].STAT = MRT_CHANNEL_STAT_INTFLAG_MASK;
+}
+
+void delay_us_async(uint32_t us, void (*done)(void)) {
+	// Non-blocking form: done() runs from MRT0_IRQHandler when time is up.
+	// A new request replaces one still pending.
+	mrt_delay_done = done;
+	MRT0->CHANNEL[MRT_CHAN_DELAY].CTRL = (MRT_ONESHOT << MRT_CHANNEL_CTRL_MODE_SHIFT | MRT_CHANNEL_CTRL_INTEN_MASK);
+	MRT0->CHANNEL[MRT_CHAN_DELAY].INTVAL = MRT_TicksFromUs(us) | (MRT_CHANNEL_INTVAL_LOAD_MASK);
+}
+
+void CTIMER_Config(void)
+{
+	// CTIMER0 paces the ADC in hardware: MR3 resets the counter and toggles
+	// MAT3, so every second match is a rising edge that starts sequence A.
+	// The same counter period doubles as the headlight PWM cycle on MAT0.
+	// Boot-time setup only; armSession() starts the count.
+	PERIPH_Acquire(PERIPH_CTIMER0);
+	CTIMER0->TCR = CTIMER_TCR_CRST_MASK;	// hold in reset while configuring
+	CTIMER0->PR = 0;
+	adc_sample_rate = ADC_CONVERSION_RATE_HZ;
+	CTIMER0->MR[CTIMER_MAT3] = (SystemCoreClock / (2 * adc_sample_rate)) - 1;
+	CTIMER0->MCR = CTIMER_MCR_MR3R_MASK;
+	CTIMER0->EMR = (0x3UL<<CTIMER_EMR_EMC3_SHIFT);	// toggle MAT3 on match
+	CTIMER0->PWMC = CTIMER_PWMC_PWMEN0_MASK;
+	LED_SetDuty(led_duty);
+	PERIPH_Release(PERIPH_CTIMER0);
 }
 
-void SysTick_Configuration(void)
+void CTIMER_SetSampleRate(uint32_t rate_hz)
 {
+	// Restart the count so the new period applies from the next edge. The
+	// headlight PWM runs at twice the pacing rate: while it is on, pacing
+	// stays at the capture rate, as ADC_IDLE_RATE_HZ would flicker at 20 Hz.
+	adc_sample_rate = rate_hz;
+	if ((led_duty != 0) && (rate_hz < ADC_CONVERSION_RATE_HZ)) {
+		rate_hz = ADC_CONVERSION_RATE_HZ;
+	}
+	CTIMER0->TCR = CTIMER_TCR_CRST_MASK;
+	CTIMER0->MR[CTIMER_MAT3] = (SystemCoreClock / (2 * rate_hz)) - 1;
+	LED_SetDuty(led_duty);	// keep the duty cycle across the new period
+	CTIMER0->TCR = CTIMER_TCR_CEN_MASK;
+}
+
+void LED_SetDuty(uint32_t percent)
+{
+	// PWM outputs start each cycle LOW and go HIGH on their match, so the
+	// ON time is the tail of the cycle. A match past MR3 never fires (off).
+	uint32_t period = CTIMER0->MR[CTIMER_MAT3] + 1;
+
+	led_duty = percent;
+	if ((percent != 0) && (CTIMER0->TCR & CTIMER_TCR_CEN_MASK)
+			&& (period > (SystemCoreClock / (2 * ADC_CONVERSION_RATE_HZ)))) {
+		CTIMER_SetSampleRate(adc_sample_rate);	// idle pacing: speed it up first
+		return;
+	}
+	CTIMER0->MR[CTIMER_MAT0] = period - (period / 100) * percent;
+}
+
+void ADC_MeasureBaseline(void)
+{
+	// Full rate into a fresh averaging window; the SEQA ISR hands the
+	// average to ADC_WatchBreath() once the window is full. Until then no
+	// breath can be detected and adc_baseline reads 0.
+	adc_head = 0;
+	adc_sum = 0;
+	adc_decim_sum = 0;
+	adc_decim_count = 0;
+	adc_baseline = 0;
+	FILTER_Reset();
+	BREATH_Reset();
+	adc_mode = ADC_MODE_BASELINE;
+	NVIC_DisableIRQ(ADC0_THCMP_IRQn);
+	ADC0->FLAGS = (1UL<<ADC_CHANNEL);
+	ADC0->INTEN = ADC_INTEN_SEQA_INTEN_MASK;
+	NVIC_ClearPendingIRQ(ADC0_SEQA_IRQn);
+	NVIC_EnableIRQ(ADC0_SEQA_IRQn);
+	CTIMER0->EMR = (CTIMER0->EMR & ~(CTIMER_EMR_EMC3_MASK)) | CTIMER_EMR_EMC3(0x3);	// MAT3 toggles: triggers
+	CTIMER_SetSampleRate(ADC_CONVERSION_RATE_HZ);	// at the current core clock
+}
+
+void ADC_Hold(void)
+{
+	// The result is taken: no more conversions, however far the detector
+	// got. MAT3 stops toggling, so the ADC sees no trigger; CTIMER0 keeps
+	// counting only while the headlight PWM needs it.
+	adc_mode = ADC_MODE_HOLD;
+	ADC0->INTEN = 0;
+	NVIC_DisableIRQ(ADC0_SEQA_IRQn);
+	NVIC_DisableIRQ(ADC0_THCMP_IRQn);
+	CTIMER0->EMR &= ~(CTIMER_EMR_EMC3_MASK);
+}
+
+void ADC_WatchBreath(uint32_t baseline)
+{
+	// Sample slowly with only the threshold comparator watching channel 2.
+	// The CPU is not interrupted until a result leaves the baseline band.
+	// The comparator sees single conversions: the baseline back to 12 bits.
+	uint32_t level = (baseline + ((1UL << ADC_OVERSAMPLE_BITS) >> 1)) >> ADC_OVERSAMPLE_BITS;
+	uint32_t low = (level > BREATH_THRESHOLD_MARGIN) ? (level - BREATH_THRESHOLD_MARGIN) : 0;
+	uint32_t high = level + BREATH_THRESHOLD_MARGIN;
+
+	if (high > ADC_MAX) {
+		high = ADC_MAX;
+	}
+	adc_baseline = baseline;
+	adc_mode = ADC_MODE_WATCH;
+	BREATH_Reset();
+
+	ADC0->THR0_LOW = ADC_THR0_LOW_THRLOW(low);
+	ADC0->THR0_HIGH = ADC_THR0_HIGH_THRHIGH(high);
+	ADC0->CHAN_THRSEL &= ~(1UL<<ADC_CHANNEL);	// threshold pair 0
+	ADC0->FLAGS = (1UL<<ADC_CHANNEL);	// drop any stale compare result
+	ADC0->INTEN = ADC_INTEN_ADCMPINTEN2(1);	// outside threshold, SEQA off
+	NVIC_ClearPendingIRQ(ADC0_THCMP_IRQn);
+	NVIC_EnableIRQ(ADC0_THCMP_IRQn);
+
+	CTIMER_SetSampleRate(ADC_IDLE_RATE_HZ);
+}
+
+void ADC0_THCMP_IRQHandler(void)
+{
+	// Breath onset: stop comparing and switch to full rate capture
+	ADC0->INTEN = ADC_INTEN_SEQA_INTEN_MASK;
+	ADC0->FLAGS = (1UL<<ADC_CHANNEL);
+	NVIC_DisableIRQ(ADC0_THCMP_IRQn);
+
+	adc_mode = ADC_MODE_CAPTURE;
+	adc_decim_sum = 0;
+	adc_decim_count = 0;
+	CTIMER_SetSampleRate(ADC_CONVERSION_RATE_HZ);
+}
+
+void ADC0_SEQA_IRQHandler(void)
+{
+	// Reading the global data register clears DATAVALID and the SEQA flag
+	uint32_t gdat = ADC0->SEQ_GDAT[0];
+#if MEASURE_ADC_COST
+	uint32_t stamp = SysTick->VAL;
+#endif
+
+	if (gdat & ADC_SEQ_GDAT_DATAVALID_MASK) {
+		uint32_t decim_sum;
+		uint32_t decim_count;
+
+		adc_result = (gdat & ADC_SEQ_GDAT_RESULT_MASK) >> ADC_SEQ_GDAT_RESULT_SHIFT;
+
+		// Decimation: 4^n conversions, summed and shifted right by n, make a
+		// sample with n more bits. The bits are real as long as the sensor
+		// noise moves the input by an LSB or more between conversions.
+		decim_sum = adc_decim_sum + adc_result;
+		decim_count = adc_decim_count + 1;
+		if (decim_count < ADC_OVERSAMPLE_COUNT) {
+			adc_decim_sum = decim_sum;
+			adc_decim_count = decim_count;
+		} else {
+			uint32_t head = adc_head;
+			uint32_t sum = adc_sum;
+			uint32_t sample;
+
+			adc_decim_sum = 0;
+			adc_decim_count = 0;
+			sample = FILTER_LowPass(FILTER_Median(decim_sum >> ADC_OVERSAMPLE_BITS));
+
+			// Running sum over the last AVG_WINDOW samples: add the new one and
+			// drop the one leaving the window (still held in the ring).
+			if (head >= AVG_WINDOW) {
+				sum -= adc_ring[(head - AVG_WINDOW) & (ADC_RING_SIZE - 1)];
+			}
+			sum += sample;
+			adc_ring[head & (ADC_RING_SIZE - 1)] = sample;
+			head++;
+
+			adc_sum = sum;
+			adc_avg = (head >= AVG_WINDOW) ? (sum >> AVG_WINDOW_SHIFT) : (sum / head);
+			adc_head = head;
+
+			// Once the idle level is known, sleep until a breath moves it
+			if ((adc_mode == ADC_MODE_BASELINE) && (head >= AVG_WINDOW)) {
+				ADC_WatchBreath(adc_avg);
+			} else if (adc_mode == ADC_MODE_CAPTURE) {
+				BREATH_Update(sample);
+			}
+#if MEASURE_ADC_COST
+			adc_output_cycles = adc_cost_cycles + ((stamp - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk);
+			adc_cost_cycles = 0;
+			return;
+#endif
+		}
+	}
+#if MEASURE_ADC_COST
+	adc_cost_cycles += (stamp - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk;
+#endif
+}
+
+void FILTER_Reset(void)
+{
+	// Each stage starts from its first sample as if it had always been there
+	filter_primed = 0;
+}
+
+uint32_t FILTER_Median(uint32_t x)
+{
+	// A spike shorter than half the window never reaches the output
+	uint16_t sorted[FILTER_MEDIAN_TAPS];
+
+	if ((filter_primed & FILTER_STAGE_MEDIAN) == 0) {
+		for (int i = 0; i < FILTER_MEDIAN_TAPS; i++) {
+			filter_taps[i] = (uint16_t)x;
+		}
+		filter_primed |= FILTER_STAGE_MEDIAN;
+	}
+	filter_taps[filter_tap] = (uint16_t)x;
+	filter_tap = (filter_tap + 1 < FILTER_MEDIAN_TAPS) ? (filter_tap + 1) : 0;
+
+	// Insertion sort: at most 21 compares for 7 taps, no division or library call
+	for (int i = 0; i < FILTER_MEDIAN_TAPS; i++) {
+		uint16_t v = filter_taps[i];
+		int j = i;
+
+		while ((j > 0) && (sorted[j - 1] > v)) {
+			sorted[j] = sorted[j - 1];
+			j--;
+		}
+		sorted[j] = v;
+	}
+	return sorted[FILTER_MEDIAN_TAPS / 2];
+}
+
+uint32_t FILTER_LowPass(uint32_t x)
+{
+#if (FILTER_IIR_ORDER == 1)
+	// Exponential average: one subtract and one shift per sample
+	if ((filter_primed & FILTER_STAGE_IIR) == 0) {
+		filter_iir[0] = (int32_t)(x << FILTER_EMA_Q);
+		filter_primed |= FILTER_STAGE_IIR;
+	}
+	filter_iir[0] += ((int32_t)(x << FILTER_EMA_Q) - filter_iir[0]) >> FILTER_EMA_SHIFT;
+	return (uint32_t)(filter_iir[0] + (1L << (FILTER_EMA_Q - 1))) >> FILTER_EMA_Q;
+#elif (FILTER_IIR_ORDER == 2)
+	// Direct form I biquad. With Q3 samples the largest product, a1 * y, is
+	// under 2^30, so the whole sum fits in 32 bits and MULS does all of it.
+	int32_t in = (int32_t)(x << FILTER_SAMPLE_Q);
+	int32_t acc;
+	int32_t out;
+
+	if ((filter_primed & FILTER_STAGE_IIR) == 0) {
+		filter_iir[0] = filter_iir[1] = filter_iir[2] = filter_iir[3] = in;
+		filter_primed |= FILTER_STAGE_IIR;
+	}
+	acc = (FILTER_B0 * in) + (FILTER_B1 * filter_iir[0]) + (FILTER_B2 * filter_iir[1])
+			- (FILTER_A1 * filter_iir[2]) - (FILTER_A2 * filter_iir[3]);
+	out = (acc + (1L << (FILTER_COEF_Q - 1))) >> FILTER_COEF_Q;
+	filter_iir[1] = filter_iir[0];
+	filter_iir[0] = in;
+	filter_iir[3] = filter_iir[2];
+	filter_iir[2] = out;
+
+	// Overshoot on a step can leave the ADC range
+#if (FILTER_SAMPLE_Q > 0)
+	out = (out + (1L << (FILTER_SAMPLE_Q - 1))) >> FILTER_SAMPLE_Q;
+#endif
+	if (out < 0) {
+		out = 0;
+	} else if (out > (int32_t)SAMPLE_MAX) {
+		out = SAMPLE_MAX;
+	}
+	return (uint32_t)out;
+#else
+	return x;
+#endif
+}
+
+void BREATH_Reset(void)
+{
+	breath_state = BREATH_WAIT;
+	breath_sum = 0;
+	breath_count = 0;
+	breath_block = 0;
+	breath_block_fill = 0;
+	breath_best = 0;
+	BAC_EstimateReset();
+}
+
+void BREATH_Update(uint32_t sample)
+{
+	// Streaming breath detector, one filtered sample at a time (already in
+	// the ring). Onset: the sample clears the breath threshold. Rise: the
+	// level keeps moving. Plateau: the slope over BREATH_SLOPE_SPAN stays
+	// within a fraction of the amplitude; only these samples are summed,
+	// in blocks of BREATH_BLOCK. Decay: the level falls away from the peak,
+	// which ends the plateau and posts the result. Thresholds scale with
+	// the amplitude, so a slow sensor or a faint breath levels off by the
+	// same rule; a slow one is still rising on its plateau, which is why
+	// the result is the highest block rather than the plateau mean.
+	uint32_t onset = adc_baseline + (BREATH_THRESHOLD_MARGIN << ADC_OVERSAMPLE_BITS);
+	uint32_t amplitude;
+	int32_t slope;
+	int32_t flat;
+	int early = 0;
+
+	if (breath_state == BREATH_WAIT) {
+		if (sample >= onset) {
+			breath_state = BREATH_RISE;
+			breath_peak = sample;
+			breath_count = 0;
+		}
+		return;
+	}
+	if (breath_state == BREATH_DONE) {
+		return;
+	}
+	if (sample > breath_peak) {
+		breath_peak = sample;
+	}
+	amplitude = breath_peak - adc_baseline;
+	slope = (int32_t)sample - (int32_t)adc_ring[(adc_head - 1 - BREATH_SLOPE_SPAN) & (ADC_RING_SIZE - 1)];
+	flat = (int32_t)(amplitude >> BREATH_FLAT_SHIFT);
+
+	if (breath_state == BREATH_RISE) {
+		breath_count++;
+		if (sample < onset) {	// died away without levelling off
+			breath_state = BREATH_WAIT;
+		} else if ((breath_count > BREATH_SLOPE_SPAN) && (slope <= flat) && (slope >= -flat)) {
+			breath_state = BREATH_PLATEAU;
+			breath_sum = 0;
+			breath_count = 0;
+			breath_block = 0;
+			breath_block_fill = 0;
+			breath_best = 0;
+			BAC_EstimateReset();
+		}
+		return;
+	}
+
+	// Plateau
+	if ((sample + (amplitude >> BREATH_DECAY_SHIFT)) < breath_peak) {
+		if (breath_count < BREATH_PLATEAU_MIN) {	// a bump, not a breath: look again
+			breath_state = BREATH_RISE;
+			breath_peak = sample;
+			breath_sum = 0;
+			breath_count = 0;
+			breath_block = 0;
+			breath_block_fill = 0;
+			breath_best = 0;
+			return;
+		}
+	} else {
+		breath_sum += sample;
+		breath_count++;
+		breath_block += sample;
+		if (++breath_block_fill == BREATH_BLOCK) {
+			if (breath_block > breath_best) {
+				breath_best = breath_block;
+			}
+			breath_block = 0;
+			breath_block_fill = 0;
+		}
+#if BAC_EARLY_DECISION
+		early = BAC_Estimate(sample);
+#endif
+		if ((breath_count < BREATH_PLATEAU_MAX) && !early) {
+			return;
+		}
+	}
+	// The result is in: stop taking IRQs until the next watch or session
+	breath_state = BREATH_DONE;
+	adc_mode = ADC_MODE_HOLD;
+	ADC0->INTEN = 0;
+	postEvent(&breath_events, EVT_BREATH_END);
+}
+
+uint32_t BREATH_Level(void)
+{
+	// The highest block mean of the plateau, as far as the detector got (the
+	// plateau mean before the first block); 0 when no plateau was found: no
+	// breath, or one that never levelled off, is not a reading
+	uint32_t primask = __get_PRIMASK();
+	uint32_t sum;
+	uint32_t count;
+	uint32_t best;
+	uint32_t early;
+
 	__disable_irq();
-	NVIC_DisableIRQ(SysTick_IRQn); //turn off the SysTick interrupt.
-	SysTick_Config(12000000);	// 12 MHz clock with interrupt every 1 second
-	adc_count = 0;
-	NVIC_EnableIRQ(SysTick_IRQn); // SysTick IRQs are on.
-	__enable_irq();
+	sum = breath_sum;
+	best = breath_best;
+	count = ((breath_state == BREATH_PLATEAU) || (breath_state == BREATH_DONE)) ? breath_count : 0;
+	early = bac_est_level;
+	__set_PRIMASK(primask);
+	if (early != 0) {	// truncated: stays on its side of BAC_LIMIT_SAMPLE
+		return early >> BAC_EST_Q;
+	}
+	if (count == 0) {
+		return 0;
+	}
+	if (best != 0) {
+		return best / BREATH_BLOCK;
+	}
+	return sum / count;
+}
+
+void BAC_EstimateReset(void)
+{
+	bac_est_fill = 0;
+	bac_est_block = 0;
+	bac_est_count = 0;
+	bac_est_fast = 0;
+	bac_est_nominal = 0;
+	bac_est_slow = 0;
+	bac_est_mean = 0;
+	bac_est_m2 = 0;
+	bac_est_level = 0;
 }
 
-//void SysTick_Handler(void)
-//{
-//	// Handle the ADC averages
-//	for (int j = 0; j < 10; j++) {
-//		ADC0->SEQ_CTRL[0] &= ~(1UL<<ADC_SEQ_CTRL_START_SHIFT);
-//		ADC0->SEQ_CTRL[0] |= (1UL<<ADC_SEQ_CTRL_START_SHIFT);
-//		adc_result = ((ADC0->DAT[2])&(ADC_DAT_RESULT_MASK));
-//		adc_result = (adc_result>>ADC_DAT_RESULT_SHIFT);
-//		// Add the result to the buffer
-//		adc_buffer[j] = adc_result;
-//	}
-//}
-
-void SysTick_Handler(void)
+int BAC_Estimate(uint32_t sample)
 {
-	for (int j = 0; j < 2; j++) {
-		ADC0->SEQ_CTRL[0] &= ~(1UL<<ADC_SEQ_CTRL_START_SHIFT);
-		ADC0->SEQ_CTRL[0] |= (1UL<<ADC_SEQ_CTRL_START_SHIFT);
-		adc_result = ((ADC0->DAT[2])&(ADC_DAT_RESULT_MASK));
-		adc_result = (adc_result>>ADC_DAT_RESULT_SHIFT);
-		adc_buffer[adc_count] = adc_result;
+	// Called by BREATH_Update() with each plateau sample; returns 1 once the
+	// result is clear. The sensor may still be settling on the plateau, so
+	// each block mean m is extrapolated along its first-order response,
+	// level = m + (m - m_prev) * r / (1 - r), at SENSOR_TAU_MIN_MS,
+	// SENSOR_TAU_MS and SENSOR_TAU_MAX_MS. Whatever the sensor's time
+	// constant within that range, the level it is heading for lies between
+	// the fast and the slow fit, and so between the means of each. The band
+	// runs from the lower to the higher of those means, widened by BAC_EST_K
+	// standard errors of the slow levels, the noisiest: Welford keeps their
+	// spread (the mean exact from the sum, the squared deviations against the
+	// mean before and after each level). The result is clear once
+	// BAC_LIMIT_SAMPLE is outside the band. Squared, there is no square root:
+	// d > k * sqrt(m2 / (n (n - 1))) is d^2 n (n - 1) > k^2 m2.
+	int32_t limit = (int32_t)(BAC_LIMIT_SAMPLE << BAC_EST_Q);
+	int32_t m;
+	int32_t step;
+	int32_t slow;
+	int32_t fast_mean;
+	int32_t slow_mean;
+	int32_t low;
+	int32_t high;
+	int32_t d;
+	uint32_t n;
+
+	bac_est_block += sample;
+	if (++bac_est_fill < BAC_EST_BLOCK) {
+		return 0;
+	}
+	m = (int32_t)((bac_est_block << BAC_EST_Q) / BAC_EST_BLOCK);
+	bac_est_fill = 0;
+	bac_est_block = 0;
+	if (breath_count == BAC_EST_BLOCK) {	// first block: nothing to fit against
+		bac_est_prev = m;
+		return 0;
+	}
+	step = m - bac_est_prev;
+	bac_est_prev = m;
+	slow = m + ((step * BAC_EST_TAIL_Q8(SENSOR_TAU_MAX_MS)) / 256);
+
+	n = ++bac_est_count;
+	bac_est_fast += m + ((step * BAC_EST_TAIL_Q8(SENSOR_TAU_MIN_MS)) / 256);
+	bac_est_nominal += m + ((step * BAC_EST_TAIL_Q8(SENSOR_TAU_MS)) / 256);
+	bac_est_slow += slow;
+	slow_mean = bac_est_slow / (int32_t)n;
+	bac_est_m2 += (int64_t)(slow - bac_est_mean) * (slow - slow_mean);
+	bac_est_mean = slow_mean;
+	if (n < BAC_EST_MIN_LEVELS) {
+		return 0;
 	}
-	adc_count = (adc_count + 1) % 10;
+
+	fast_mean = bac_est_fast / (int32_t)n;
+	low = (fast_mean < slow_mean) ? fast_mean : slow_mean;
+	high = (fast_mean < slow_mean) ? slow_mean : fast_mean;
+	if (low > limit) {
+		d = low - limit;
+	} else if (high < limit) {
+		d = limit - high;
+	} else {
+		return 0;
+	}
+	if (((uint64_t)((int64_t)d * d) * n * (n - 1))
+			<= ((uint64_t)(BAC_EST_K * BAC_EST_K) * (uint64_t)((bac_est_m2 > 0) ? bac_est_m2 : 0))) {
+		return 0;
+	}
+	// The mean at SENSOR_TAU_MS lies between the other two: same side
+	d = bac_est_nominal / (int32_t)n;
+	bac_est_level = (d > 0) ? (uint32_t)d : 1;
+	return 1;
 }
 
 void init_ADC(void) {
-	SYSCON->PDRUNCFG &=	~(SYSCON_PDRUNCFG_ADC_PD_MASK);
-	SYSCON->SYSAHBCLKCTRL0 |= ( SYSCON_SYSAHBCLKCTRL0_ADC_MASK | SYSCON_SYSAHBCLKCTRL0_SWM_MASK);
-	SYSCON->PRESETCTRL0 &= ~(SYSCON_PRESETCTRL0_ADC_RST_N_MASK);
-	SYSCON->PRESETCTRL0 |= (SYSCON_PRESETCTRL0_ADC_RST_N_MASK);
+	// Boot-time setup only; armSession() powers it up and enables the IRQ
+	PERIPH_Acquire(PERIPH_ADC);
 	SYSCON->ADCCLKSEL &= ~(SYSCON_ADCCLKSEL_SEL_MASK);
 	SYSCON->ADCCLKDIV =	1;
+	PERIPH_Acquire(PERIPH_SWM);
 	SWM0->PINENABLE0 &=	~(SWM_PINENABLE0_ADC_2_MASK);
+	PERIPH_Release(PERIPH_SWM);
+
+	// Sequence A: one conversion of the sensor channel per CTIMER0 MAT3 rising
+	// edge, interrupt at the end of each conversion.
+	NVIC_DisableIRQ(ADC0_SEQA_IRQn);
+	ADC0->SEQ_CTRL[0] = 0;	// TRIGGER may only change while SEQ_ENA is clear
+	ADC0->SEQ_CTRL[0] = (1UL<<ADC_CHANNEL)
+			| (ADC_TRIG_T0_MAT3<<ADC_SEQ_CTRL_TRIGGER_SHIFT)
+			| (1UL<<ADC_SEQ_CTRL_TRIGPOL_SHIFT);
+	ADC0->SEQ_CTRL[0] |= (1UL<<ADC_SEQ_CTRL_SEQ_ENA_SHIFT);
+	ADC0->INTEN = 0;
+	PERIPH_Release(PERIPH_ADC);
 }
 
-void MRT_Config() {
-	__disable_irq(); // turn off globally
-	NVIC_DisableIRQ(MRT0_IRQn);
+void MRT_Config(void) {
+	// Boot-time setup of the one-shot BAC timer; startBACTimer() loads it.
+	// The LCD refresh task may hold the MRT too, so channel 0 is left alone.
+	PERIPH_Acquire(PERIPH_MRT);
+	MRT0->CHANNEL[MRT_CHAN1].CTRL = (MRT_ONESHOT << MRT_CHANNEL_CTRL_MODE_SHIFT | MRT_CHANNEL_CTRL_INTEN_MASK);
+	PERIPH_Release(PERIPH_MRT);
+}
 
-	SYSCON->MAINCLKSEL = (0x0<<SYSCON_MAINCLKSEL_SEL_SHIFT);
-	SYSCON->MAINCLKUEN &= ~(0x1);
-	SYSCON->MAINCLKUEN |= 0x1;
+void setClockPhase(uint32_t phase) {
+	// Clock governor: switch the FRO profile, then re-derive everything that
+	// was programmed in system clock ticks so timing does not change.
+	uint32_t old_hz = SystemCoreClock;
+	uint32_t new_hz;
+	uint32_t primask;
+	uint32_t lposc_off;
 
-	BOARD_BootClockFRO30M();
+	if (phase == clock_phase) {
+		return;
+	}
+	primask = __get_PRIMASK();
+	__disable_irq();
 
-	SYSCON->SYSAHBCLKCTRL0 |= (SYSCON_SYSAHBCLKCTRL0_MRT_MASK);
-	SYSCON->PRESETCTRL0 &= ~(SYSCON_PRESETCTRL0_MRT_RST_N_MASK);
-	SYSCON->PRESETCTRL0 |= (SYSCON_PRESETCTRL0_MRT_RST_N_MASK);
+	// The board setup powers the LPOSC up, but it belongs to PERIPH_WKT
+	lposc_off = SYSCON->PDRUNCFG & SYSCON_PDRUNCFG_LPOSC_PD_MASK;
+	if (phase == CLOCK_PHASE_BURST) {
+		BOARD_BootClockFRO30M();
+	} else {
+		BOARD_BootClockFRO18M();
+	}
+	SYSCON->PDRUNCFG |= lposc_off;
+	clock_phase = phase;
+	new_hz = SystemCoreClock;
 
-	MRT0->CHANNEL[MRT_CHAN0].CTRL = (MRT_REPEAT << MRT_CHANNEL_CTRL_MODE_SHIFT | MRT_CHANNEL_CTRL_INTEN_MASK);
-	MRT0->CHANNEL[MRT_CHAN0].INTVAL = INIT_COUNT_IRQ_CH0 | (MRT_CHANNEL_INTVAL_LOAD_MASK);
-	MRT0->CHANNEL[MRT_CHAN1].CTRL = (MRT_REPEAT << MRT_CHANNEL_CTRL_MODE_SHIFT | MRT_CHANNEL_CTRL_INTEN_MASK);
-	MRT0->CHANNEL[MRT_CHAN1].INTVAL = INIT_COUNT_IRQ_CH1 | (MRT_CHANNEL_INTVAL_LOAD_MASK);
+	// CTIMER0: ADC pacing period and the headlight PWM that shares it
+	if ((periph_refs[PERIPH_CTIMER0] != 0) && (CTIMER0->TCR & CTIMER_TCR_CEN_MASK)) {
+		CTIMER_SetSampleRate(adc_sample_rate);
+	}
+	// MRT: the in-flight delay and the BAC timer keep their remaining time
+	if (periph_refs[PERIPH_MRT] != 0) {
+		rescaleMRTChannel(MRT_CHAN_DELAY, old_hz, new_hz);
+		rescaleMRTChannel(MRT_CHAN1, old_hz, new_hz);
+	}
+#if defined(SDK_DEBUGCONSOLE) && (SDK_DEBUGCONSOLE != 0)
+	USART_SetBaudRate((USART_Type *)BOARD_DEBUG_USART_BASEADDR, BOARD_DEBUG_USART_BAUDRATE, BOARD_DEBUG_USART_CLK_FREQ);
+#endif
+	// delay_us()/delay_us_async() read the clock on every call
 
-	NVIC_EnableIRQ(MRT0_IRQn);
-	__enable_irq(); // global
+	__set_PRIMASK(primask);
+}
+
+void rescaleMRTChannel(uint32_t chan, uint32_t old_hz, uint32_t new_hz) {
+	uint32_t remaining;
+	uint32_t reload;
+
+	if ((MRT0->CHANNEL[chan].STAT & MRT_CHANNEL_STAT_RUN_MASK) == 0) {
+		return;
+	}
+	remaining = (uint32_t)(((uint64_t)MRT0->CHANNEL[chan].TIMER * new_hz) / old_hz);
+	reload = (uint32_t)(((uint64_t)(MRT0->CHANNEL[chan].INTVAL & MRT_CHANNEL_INTVAL_IVALUE_MASK) * new_hz) / old_hz);
+	if (remaining == 0) {
+		remaining = 1;
+	}
+	// LOAD restarts the count now; the plain write only sets the repeat value
+	MRT0->CHANNEL[chan].INTVAL = remaining | (MRT_CHANNEL_INTVAL_LOAD_MASK);
+	MRT0->CHANNEL[chan].INTVAL = reload;
 }
 
 void MRT0_IRQHandler(void) {
-	int static chan = 0;
-	float static duty_factor = INIT_PWM_DUTY_FACTOR;
-	int static pwm_state = 1;
+	uint32_t flags = MRT0->IRQ_FLAG;
 
-	if (MRT0->IRQ_FLAG & (1<<MRT_GFLAG0)) {
-		chan = 0;
-	} else {
-		chan = 1;
-	}
-
-	MRT0->CHANNEL[chan].STAT = MRT_CHANNEL_STAT_INTFLAG_MASK;
-	if ((chan == 0) & (lights_on == 0)) {
-		if ((bac_checked == 1) & (bac <= 8999)) {	// BAC <= 0.08 (within the legal limit)
-			lights_on = 1;
-			if (pwm_state == 1) // Turn on the LED if it's the ON time for PWM
-			{
-				GPIO->SET[0] = (1UL<<LED_HEADLIGHTS);
-				MRT0->CHANNEL[MRT_CHAN0].INTVAL = (uint32_t)(LED_PERIOD_TICKS * (1-duty_factor)) & ~(MRT_CHANNEL_INTVAL_LOAD_MASK);
-				pwm_state = 0;
-			} else {
-				GPIO->CLR[0] = (1UL<<LED_HEADLIGHTS);
-				MRT0->CHANNEL[MRT_CHAN0].INTVAL = (uint32_t)(LED_PERIOD_TICKS * (duty_factor)) & ~(MRT_CHANNEL_INTVAL_LOAD_MASK);
-				pwm_state = 1;
-			}
-		} else {	// BAC > 0.08 , car will not start
-			GPIO->CLR[0] = (1UL<<LED_HEADLIGHTS);
-			lights_on = 0;
-		}
-	} else {	// Channel 1 will execute the BAC display
-		//******************
-		// Calculate the ADC normalization:
-		// ((aMax - aMin) / (vMax - vMin)) * (adc_avg - vMin)
-		// Breath to blood alcohol conversion: 2100:1 -> 0.21
-		// Internal resistance of the sensor (R0/Rs): 0.4
-		// vMin = 2050, vMax = 4095
-		// aMin = 0.05 mg/L, aMax = 10 mg/L
-		// ((10 - 0.05) / (4095 - 2050)) * (adc_avg - 2050) * (0.4) * (0.21)
-		// (199/40900) * (adc_avg - 2050) * (4/10) * (21/100)
-		//******************
-		if (bac_checked == 0) {
-			if (adc_avg <= 2050) {	// Handle any fluctuation
-				bac = 0;
-				bac_checked = 1;
-			} else {	// Convert air alcohol to BAC
-				bac = (16716) * (adc_avg - 2050) / (40900000);
-				bac_checked = 1;
-			}
+	if (flags & (1<<MRT_GFLAG0)) {	// Channel 0 is the delay service
+		void (*done)(void) = mrt_delay_done;
+
+		MRT0->CHANNEL[MRT_CHAN_DELAY].STAT = MRT_CHANNEL_STAT_INTFLAG_MASK;
+		mrt_delay_done = 0;
+		if (done) {
+			done();
 		}
-		if (is_displayed == 0) {
-			delay();
+	}
+	if (flags & (1<<MRT_GFLAG1)) {	// Channel 1 will execute the BAC display
+		MRT0->CHANNEL[MRT_CHAN1].STAT = MRT_CHANNEL_STAT_INTFLAG_MASK;
+		postEvent(&timer_events, EVT_BAC_TIMER);
+	}
+	return;
+}
+
+void showBACResult(void) {
+	// Runs at the low clock: the work here is a division and shadow writes,
+	// and the refresh task sends the text to the panel afterwards anyway
+	if (bac_checked == 0) {
+		uint32_t level = BREATH_Level();
+
+		bac = (level != 0) ? BAC_FromAdc(level) : BAC_NO_BREATH;
+		bac_checked = 1;
+		ADC_Hold();
+	}
+	if (is_displayed == 0) {
+		if (bac == BAC_NO_BREATH) {	// Nothing read: the next press retries
+			setLCDNoBreathMsg();
+		} else {
 			setLCDBACMsg(bac);
 			setLCDNewLine();
-			if (bac <= 8999) {
+			if (bac <= BAC_LIMIT) {	// BAC <= 0.08 (within the legal limit)
 				setLCDResultMsg(1);
-			} else {
+				LED_SetDuty(INIT_PWM_DUTY_PERCENT);
+				lights_on = 1;
+				readings = 0;	// only failed readings count towards the lockout
+			} else {	// BAC > 0.08 , car will not start
 				setLCDResultMsg(0);
+				readings++;	// Increment the number of readings (max of 3)
 			}
-			readings++;	// Increment the number of readings (max of 3)
-			is_displayed = 1;
+		}
+		is_displayed = 1;
+		if (lights_on == 0) {	// Nothing runs until the next press retries
+			endSession();
 		}
 	}
 	return;
 }
 
+int BAC_FromAdc(uint32_t avg) {
+	//******************
+	// Calculate the ADC normalization:
+	// ((aMax - aMin) / (vMax - vMin)) * (adc_avg - vMin)
+	// Breath to blood alcohol conversion: 2100:1 -> 0.21
+	// Internal resistance of the sensor (R0/Rs): 0.4
+	// vMin = 2050, vMax = 4095
+	// aMin = 0.05 mg/L, aMax = 10 mg/L
+	// ((10 - 0.05) / (4095 - 2050)) * (adc_avg - 2050) * (0.4) * (0.21)
+	// (199/40900) * (adc_avg - 2050) * (4/10) * (21/100)
+	// That is % BAC; the result is in 0.00001 %, the unit of setLCDBACMsg()
+	// and of BAC_LIMIT: 16716 / 409 per count. avg has
+	// ADC_OVERSAMPLE_BITS more bits than a count.
+	//******************
+	uint32_t floor = (uint32_t)BAC_ADC_FLOOR << ADC_OVERSAMPLE_BITS;
+
+	if (avg <= floor) {	// Handle any fluctuation
+		return 0;
+	}
+	// Convert air alcohol to BAC; 16716 * 2^16 still fits 31 bits
+	return (int)(((uint32_t)BAC_SCALE_NUM * (avg - floor)) / ((uint32_t)BAC_SCALE_DEN << ADC_OVERSAMPLE_BITS));
+}
+
 void PIN_INT0_IRQHandler(void) {
 	if (PINT->IST & (1<<0)) {
+#if MEASURE_PRESS_LATENCY
+		press_stamp = SysTick->VAL;
+#endif
 		// remove the any IRQ flag for Channel 0 of GPIO INT
 		PINT->IST = (1<<0);
-		// DISPLAY WELCOME MESSAGE OR BLOW MESSAGE
-		press++;
-		//Instruct the driver to blow (if button press is not a reset)
-		if (press == 1) {
-			bac_checked = 0;
+		PINT->CIENF = (1<<0);	// contact bounce: no more edges until BUTTON_Rearm()
+		postEvent(&button_events, EVT_BUTTON_PRESS);
+	} else {
+		asm("NOP"); // Place a breakpoint here if debugging.
+	}
+	return;
+}
+
+void handleButtonPress(void) {
+	// DISPLAY WELCOME MESSAGE OR BLOW MESSAGE
+	press++;
+	//Instruct the driver to blow (if button press is not a reset)
+	if (press == 1) {
+		if (readings >= 3) {	// Still locked out from the last session
 			clearLCDDisplay();
-			setLCDBlowMsg();
-			SysTick_Configuration();
-			MRT_Config();
-		} else {
-			// For all even button presses, it will either be
-			// a car shutdown or a BAC update
-			if (lights_on == 1) {
-				// If car is already started,
-				// display final message and turn off lights
-				GPIO->CLR[0] = (1UL<<LED_HEADLIGHTS);
+			setLCDFinalMsg();
+			press = 0;
+			return;
+		}
+		stopIdleTimer();
+		clearLCDDisplay();
+		setLCDBlowMsg();
+		armSession();
+#if MEASURE_PRESS_LATENCY
+		press_latency_cycles = (press_stamp - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk;
+#endif
+	} else if (is_displayed == 0) {
+		// No result yet: a late bounce or an impatient driver. A retry
+		// now would watch for a breath before any baseline is measured.
+		press--;
+	} else {
+		// For all even button presses, it will either be
+		// a car shutdown or a BAC update
+		if (lights_on == 1) {
+			// If car is already started,
+			// display final message and turn off lights
+			LED_SetDuty(0);
+			setLCDFinalMsg();
+			lights_on = 0;
+			endSession();
+			press = 0;
+		} else {	// Car could not start (BAC too high, or no breath read)
+			if (readings < 3) {
+				clearLCDDisplay();
+				setLCDRetryMsg();
+				setLCDNewLine();
+				setLCDBlowMsg();
+				stopIdleTimer();
+				armSession();	// a new baseline: the sensor may still be coming down from the last breath
+			} else {	// Max readings reached
+				clearLCDDisplay();
 				setLCDFinalMsg();
-				lights_on = 0;
-			} else {	// Car could not start (BAC too high)
-				if (readings < 3) {
-					clearLCDDisplay();
-					setLCDRetryMsg();
-					setLCDNewLine();
-					setLCDBlowMsg();
-					is_displayed = 0;
-				} else {	// Max readings reached
-					clearLCDDisplay();
-					setLCDFinalMsg();
-					is_displayed = 1;
-				}
+				press = 0;	// the failed result already ended the session
 			}
 		}
+	}
+}
+
+void BUTTON_Debounce(void) {
+	// Unmask the button BUTTON_DEBOUNCE_MS after a press was handled. The
+	// delay channel belongs to the refresh task while it runs: LCD_Refresh()
+	// starts the wait once the panel has caught up.
+	__disable_irq();
+	if (button_debounce == 0) {
+		button_debounce = 1;
+		PERIPH_Acquire(PERIPH_MRT);	// released by BUTTON_Rearm()
+	}
+	if (lcd_dirty == 0) {
+		delay_us_async(BUTTON_DEBOUNCE_MS * 1000U, BUTTON_Rearm);
+	}
+	__enable_irq();
+}
+
+void BUTTON_Rearm(void) {
+	// Drop whatever the bounce left latched and listen again
+	PINT->FALL = (1<<0);
+	PINT->IST = (1<<0);
+	NVIC_ClearPendingIRQ(PIN_INT0_IRQn);
+	PINT->SIENF = (1<<0);
+	button_debounce = 0;
+	PERIPH_Release(PERIPH_MRT);
+}
+
+void armSession(void) {
+	// Everything was configured once at boot; a session only powers the
+	// blocks back up and reloads counters and intervals.
+	bac_checked = 0;
+	is_displayed = 0;
+	lights_on = 0;
+
+	PERIPH_Acquire(PERIPH_ADC);
+	PERIPH_Acquire(PERIPH_CTIMER0);
+	PERIPH_Acquire(PERIPH_MRT);
+
+	// Headlights are driven by MAT0 from here on, not by GPIO
+	PERIPH_Acquire(PERIPH_SWM);
+	SWM0->PINASSIGN.PINASSIGN4 = (SWM0->PINASSIGN.PINASSIGN4 & ~(SWM_PINASSIGN4_T0_MAT0_MASK))
+			| SWM_PINASSIGN4_T0_MAT0(LED_HEADLIGHTS);
+	PERIPH_Release(PERIPH_SWM);
+	ADC_MeasureBaseline();
+
+	startBACTimer();
+	session_active = 1;
+}
+
+void endSession(void) {
+	// Stop everything that needs the system clock so the idle policy can
+	// power down. Callers that want the next press to start a new session
+	// set press back to 0; after a failed result it retries instead.
+	if (session_active == 0) {
+		return;
+	}
+	CTIMER0->TCR = 0;
+	ADC0->INTEN = 0;
+	NVIC_DisableIRQ(ADC0_SEQA_IRQn);
+	NVIC_DisableIRQ(ADC0_THCMP_IRQn);
+	stopBACTimer();
+
+	// A gated CTIMER0 freezes MAT0 wherever it was: hand the headlight pin
+	// back to GPIO, which holds it low.
+	PERIPH_Acquire(PERIPH_SWM);
+	SWM0->PINASSIGN.PINASSIGN4 |= SWM_PINASSIGN4_T0_MAT0_MASK;	// unassigned
+	PERIPH_Release(PERIPH_SWM);
+	PERIPH_Release(PERIPH_CTIMER0);
+	PERIPH_Release(PERIPH_ADC);
+	PERIPH_Release(PERIPH_MRT);
+	session_active = 0;
+	startIdleTimer();
+}
+
+void startBACTimer(void) {
+	// Fallback for a breath the detector never sees end: the result from
+	// whatever was captured, BAC_RESULT_DELAY_MS from now
+	MRT0->CHANNEL[MRT_CHAN1].STAT = MRT_CHANNEL_STAT_INTFLAG_MASK;
+	MRT0->CHANNEL[MRT_CHAN1].INTVAL = MRT_TicksFromUs(BAC_RESULT_DELAY_MS * 1000U) | (MRT_CHANNEL_INTVAL_LOAD_MASK);
+}
+
+void stopBACTimer(void) {
+	MRT0->CHANNEL[MRT_CHAN1].INTVAL = (MRT_CHANNEL_INTVAL_LOAD_MASK);	// 0: stop
+	MRT0->CHANNEL[MRT_CHAN1].STAT = MRT_CHANNEL_STAT_INTFLAG_MASK;
+}
+
+void startIdleTimer(void) {
+	// Only with DPD_ENABLE. The WKT runs from the low-power oscillator,
+	// which keeps counting in power-down, so the timeout also elapses while
+	// enterIdle() sleeps. Held (with the LPOSC) until stopIdleTimer().
+#if DPD_ENABLE
+	PERIPH_Acquire(PERIPH_WKT);
+	WKT->CTRL = WKT_CTRL_CLKSEL_MASK | WKT_CTRL_CLEARCTR_MASK | WKT_CTRL_ALARMFLAG_MASK;
+	WKT->COUNT = INACTIVITY_TIMEOUT_S * LPOSC_HZ;
+	EnableDeepSleepIRQ(WKT_IRQn);
+#endif
+}
+
+void stopIdleTimer(void) {
+#if DPD_ENABLE
+	WKT->CTRL = WKT_CTRL_CLKSEL_MASK | WKT_CTRL_CLEARCTR_MASK | WKT_CTRL_ALARMFLAG_MASK;
+	NVIC_ClearPendingIRQ(WKT_IRQn);
+	PERIPH_Release(PERIPH_WKT);
+#endif
+}
+
+void WKT_IRQHandler(void) {
+	WKT->CTRL |= WKT_CTRL_ALARMFLAG_MASK;
+	postEvent(&wake_events, EVT_IDLE_TIMEOUT);
+}
+
+void enterDeepPowerDown(void) {
+	// Only the PMU general-purpose registers survive; keep the counters there
+	// and come back through reset with resumeFromDeepPowerDown(). The panel
+	// stays powered and keeps its text: leave it on the greeting, which
+	// BUTTON (the wake pin) answers.
+	setLCDInitialMsg();
+	__disable_irq();
+	while (lcd_dirty) {	// the MRT refresh task sends it
+		POWER_EnterSleep();
+		__enable_irq();
+		__disable_irq();
+	}
+	POWER_SetRetainData(kPmu_GenReg0, RETAIN_MAGIC | ((uint32_t)readings & RETAIN_READINGS_MASK));
+	POWER_DeepPowerDownWakeupSourceSelect(DPD_WAKEUP_PIN);
+	POWER_ClrWakeupPinFlag();
+	POWER_EnterDeepPowerDownMode();
+}
+
+int resumeFromDeepPowerDown(void) {
+	uint32_t retained = POWER_GetRetainData(kPmu_GenReg0);
+
+	if ((POWER_GetDeepPowerDownModeFlag() == 0) || ((retained & RETAIN_MAGIC_MASK) != RETAIN_MAGIC)) {
+		return 0;	// cold boot
+	}
+	POWER_ClrDeepPowerDownModeFlag();
+	readings = (int)(retained & RETAIN_READINGS_MASK);
+	return 1;
+}
+
+void enterIdle(void) {
+	// Called with IRQs masked once the event queues are empty. Pick the
+	// deepest mode that keeps every pending wake source alive.
+	if ((session_active == 0) && (lcd_dirty == 0) && (mrt_delay_done == 0)) {
+		// Only the button or the idle timeout can create work: PINT0 and the
+		// WKT (LPOSC kept running while it is held) both wake from power-down
+		SYSCON->PDAWAKECFG = SYSCON->PDRUNCFG;	// come back up as we went down
+		if (periph_refs[PERIPH_WKT] == 0) {
+			// POWER_EnterPowerDown() only ever clears PDSLEEPCFG bits: once
+			// the WKT has run, the LPOSC would stay up in every later sleep
+			SYSCON->PDSLEEPCFG |= SYSCON_PDSLEEPCFG_LPOSC_PD_MASK;
+		}
+		POWER_EnterPowerDown((periph_refs[PERIPH_WKT] != 0) ? kPDSLEEPCFG_DeepSleepLPOscActive : 0);
 	} else {
-		asm("NOP"); // Place a breakpoint here if debugging.
+		// CTIMER/ADC sampling, the threshold compare and the MRT channels
+		// all run from the system clock, which only sleep mode keeps
+		POWER_EnterSleep();
 	}
-	return;
 }
 
 int main(void) {
+	int warm;
 
 	// disable interrupts (global (all) and SysTick (specific))
 	__disable_irq(); // turn off globally
 
+	// Waking from deep power-down: restore the session counters
+	warm = resumeFromDeepPowerDown();
+	setClockPhase(CLOCK_PHASE_LOW);
+
 	// HANDLE INTERRUPT AND GPIO SETUP
 	NVIC_DisableIRQ(PIN_INT0_IRQn);
 
-	SYSCON->SYSAHBCLKCTRL0 |= (SYSCON_SYSAHBCLKCTRL0_GPIO0_MASK | SYSCON_SYSAHBCLKCTRL0_GPIO_INT_MASK);
-	SYSCON->PRESETCTRL0 &= ~(SYSCON_PRESETCTRL0_GPIO0_RST_N_MASK | SYSCON_PRESETCTRL0_GPIOINT_RST_N_MASK);
-	SYSCON->PRESETCTRL0 |= (SYSCON_PRESETCTRL0_GPIO0_RST_N_MASK | SYSCON_PRESETCTRL0_GPIOINT_RST_N_MASK);
+	PERIPH_Acquire(PERIPH_GPIO0);
+	PERIPH_Acquire(PERIPH_GPIO_INT);
 
 	// Set push button to input
 	GPIO->DIRCLR[0] = (1UL<<BUTTON);
@@ -269,22 +1338,8 @@ int main(void) {
 	GPIO->DIRSET[0] = (1UL<<RW);
 	GPIO->CLR[0] = (1UL<<EN);
 	GPIO->DIRSET[0] = (1UL<<EN);
-	GPIO->CLR[0] = (1UL<<D0);
-	GPIO->DIRSET[0] = (1UL<<D0);
-	GPIO->CLR[0] = (1UL<<D1);
-	GPIO->DIRSET[0] = (1UL<<D1);
-	GPIO->CLR[0] = (1UL<<D2);
-	GPIO->DIRSET[0] = (1UL<<D2);
-	GPIO->CLR[0] = (1UL<<D3);
-	GPIO->DIRSET[0] = (1UL<<D3);
-	GPIO->CLR[0] = (1UL<<D4);
-	GPIO->DIRSET[0] = (1UL<<D4);
-	GPIO->CLR[0] = (1UL<<D5);
-	GPIO->DIRSET[0] = (1UL<<D5);
-	GPIO->CLR[0] = (1UL<<D6);
-	GPIO->DIRSET[0] = (1UL<<D6);
-	GPIO->CLR[0] = (1UL<<D7);
-	GPIO->DIRSET[0] = (1UL<<D7);
+	GPIO->CLR[0] = LCD_DATA_MASK;
+	GPIO->DIRSET[0] = LCD_DATA_MASK;
 
 	SYSCON->PINTSEL[0] = BUTTON;
 	PINT->ISEL = 0x00;
@@ -292,124 +1347,217 @@ int main(void) {
 	PINT->SIENF = 0b00000001;
 	PINT->IST = 0xFF;
 
-	NVIC_EnableIRQ(PIN_INT0_IRQn);
+	EnableDeepSleepIRQ(PIN_INT0_IRQn);	// NVIC plus STARTERP0 wake-up from power-down
 
 	//Write initial greeting to LCD
 	GPIO->CLR[0] = (1UL<<RW);
+	init_LCD(warm);
 	setLCDInitialMsg();
 
-	__enable_irq(); // global
-
-	// Initialize ADC for sensing alcohol
+	// One-time setup of the session peripherals, left gated until a press
 	init_ADC();
-	ADC0->SEQ_CTRL[0] |= (1UL<<2);
-	ADC0->SEQ_CTRL[0] |= (1UL<<ADC_SEQ_CTRL_TRIGPOL_SHIFT);
-	ADC0->SEQ_CTRL[0] |= (1UL<<ADC_SEQ_CTRL_SEQ_ENA_SHIFT);
-	ADC0->SEQ_CTRL[0] |= (1UL<<ADC_SEQ_CTRL_START_SHIFT);
+	CTIMER_Config();
+	MRT_Config();
+#if MEASURE_PRESS_LATENCY || MEASURE_ADC_COST
+	SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;	// free-running, no interrupt
+	SysTick->VAL = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+#endif
+	startIdleTimer();
 
-	adc_avg = 0;
+	__enable_irq(); // global
+
+	// ISRs only post events; all application work and LCD writes happen here
     while(1) {
-    	adc_sum = 0;
-    	for (int i = 0; i < 10; i++) {
-    		adc_sum += adc_buffer[i];
+    	uint8_t event;
+
+    	while (takeEvent(&button_events, &event)) {
+    		handleButtonPress();
+    		BUTTON_Debounce();
     	}
-    	adc_avg = adc_sum / 10;
+    	while (takeEvent(&timer_events, &event)) {
+    		showBACResult();
+    	}
+    	while (takeEvent(&breath_events, &event)) {
+    		stopBACTimer();	// the plateau is in: no need to wait out the fallback
+    		showBACResult();
+    	}
+    	while (takeEvent(&wake_events, &event)) {
+    		if (session_active == 0) {
+    			enterDeepPowerDown();
+    		}
+    	}
+
+    	// Re-check with interrupts masked so a post cannot slip in before WFI;
+    	// a pending IRQ still wakes the core and runs once they are re-enabled.
+    	__disable_irq();
+    	if ((button_events.head == button_events.tail) && (timer_events.head == timer_events.tail)
+    			&& (breath_events.head == breath_events.tail) && (wake_events.head == wake_events.tail)) {
+    		enterIdle();
+    	}
+    	__enable_irq();
     }
     return 0 ;
 }
 
-void displayON(void){
-//	clearLCDDisplay();
-	GPIO->CLR[0] = (1UL<<RS);	//interprets as command
-	GPIO->SET[0] = (1UL<<EN);	//Start HIGH
-	delay();
-
-	//Display on
-	GPIO->CLR[0] = (1UL<<D0);
-	GPIO->CLR[0] = (1UL<<D1);
-	GPIO->SET[0] = (1UL<<D2);
-	GPIO->SET[0] = (1UL<<D3);
-	GPIO->CLR[0] = (1UL<<D4);
-	GPIO->CLR[0] = (1UL<<D5);
-	GPIO->CLR[0] = (1UL<<D6);
-	GPIO->CLR[0] = (1UL<<D7);
-
-	GPIO->CLR[0] = (1UL<<EN);	//to-LOW
-
-	// Set to 2-line mode
-	GPIO->SET[0] = (1UL<<EN);	//Start HIGH
-	delay();
-
-	GPIO->CLR[0] = (1UL<<D0);
-	GPIO->CLR[0] = (1UL<<D1);
-	GPIO->CLR[0] = (1UL<<D2);
-	GPIO->SET[0] = (1UL<<D3);
-	GPIO->SET[0] = (1UL<<D4);
-	GPIO->SET[0] = (1UL<<D5);
-	GPIO->CLR[0] = (1UL<<D6);
-	GPIO->CLR[0] = (1UL<<D7);
-
-	GPIO->CLR[0] = (1UL<<EN);	//to-LOW
+void writeLCDByte(uint8_t value, int is_data) {
+	// One bus transfer, no waiting: callers pace writes to the panel
+	uint32_t pins = lcd_pins[value];
+
+	if (is_data) {
+		GPIO->SET[0] = (1UL<<RS);	//set HIGH to interpret digital pins as data
+	} else {
+		GPIO->CLR[0] = (1UL<<RS);	//interprets as command
+	}
+	GPIO->SET[0] = pins;
+	GPIO->CLR[0] = pins ^ LCD_DATA_MASK;
+
+	GPIO->SET[0] = (1UL<<EN);	//begin HIGH to load data bits into D0-D7
+	for (int i = 0; i < LCD_EN_PULSE_NOPS; i++) {
+		asm("NOP");
+	}
+	GPIO->CLR[0] = (1UL<<EN);	//end LOW to load data bits
 }
 
-void clearLCDDisplay(void){
-	GPIO->CLR[0] = (1UL<<RS);	//interprets as command
-	GPIO->SET[0] = (1UL<<EN);	//Start HIGH
-	delay();
+int isLCDBusy(void) {
+#if LCD_USE_BUSY_FLAG
+	// Instruction read (RS low, RW high): the controller drives BF on D7
+	// and the address counter on D0-D6, so the whole bus turns to input
+	uint32_t busy;
+
+	GPIO->DIRCLR[0] = LCD_DATA_MASK;
+	GPIO->CLR[0] = (1UL<<RS);
+	GPIO->SET[0] = (1UL<<RW);
+	GPIO->SET[0] = (1UL<<EN);
+	for (int i = 0; i < LCD_EN_PULSE_NOPS; i++) {
+		asm("NOP");
+	}
+	busy = GPIO->PIN[0] & (1UL<<D7);
+	GPIO->CLR[0] = (1UL<<EN);
+	GPIO->CLR[0] = (1UL<<RW);
+	GPIO->DIRSET[0] = LCD_DATA_MASK;
+	return (busy != 0);
+#else
+	return 0;
+#endif
+}
+
+void waitLCDReady(void) {
+#if LCD_USE_BUSY_FLAG
+	for (int i = 0; (i < LCD_BUSY_POLL_LIMIT) && isLCDBusy(); i++) {
+	}
+#else
+	delay_us(LCD_CLEAR_US);	// worst case: only called after a clear
+#endif
+}
+
+void init_LCD(int warm) {
+	// Blocking bring-up, only at boot before the refresh task runs.
+	// BF is not valid until the first function set, so that one waits blind.
+	// After deep power-down the panel stayed powered: skip the power-on wait.
+	PERIPH_Acquire(PERIPH_MRT);	// for delay_us()
 
-	//Clear display
-	GPIO->SET[0] = (1UL<<D0);
-	GPIO->CLR[0] = (1UL<<D1);
-	GPIO->CLR[0] = (1UL<<D2);
-	GPIO->CLR[0] = (1UL<<D3);
-	GPIO->CLR[0] = (1UL<<D4);
-	GPIO->CLR[0] = (1UL<<D5);
-	GPIO->CLR[0] = (1UL<<D6);
-	GPIO->CLR[0] = (1UL<<D7);
+	if (!warm) {
+		delay_us(LCD_POWER_ON_US);
+	}
+	writeLCDByte(LCD_CMD_FUNCTION_2LINE, 0);
+	delay_us(LCD_CMD_US);
+	displayON();
+	waitLCDReady();
+	writeLCDByte(LCD_CMD_CLEAR, 0);
+	waitLCDReady();
 
-	GPIO->CLR[0] = (1UL<<EN);	//to-LOW
+	for (int i = 0; i < (LCD_ROWS * LCD_COLS); i++) {
+		lcd_shadow[i] = ' ';
+		lcd_panel[i] = ' ';
+	}
+	lcd_cursor = 0;
+	lcd_addr = 0;
+	lcd_dirty = 0;
+	PERIPH_Release(PERIPH_MRT);
+	NVIC_EnableIRQ(MRT0_IRQn);
 }
 
-void moveLCDCursor(void){
-	GPIO->CLR[0] = (1UL<<RS);	//interprets as command
-	GPIO->SET[0] = (1UL<<EN);	//Start HIGH
-	delay();
+void LCD_StartRefresh(void) {
+	// The refresh task only runs while the shadow has changes to send
+	if (lcd_dirty) {
+		delay_us_async(LCD_REFRESH_US, LCD_Refresh);
+	}
+}
 
-	//move cursor right
-	GPIO->CLR[0] = (1UL<<D0);
-	GPIO->CLR[0] = (1UL<<D1);
-	GPIO->SET[0] = (1UL<<D2);
-	GPIO->CLR[0] = (1UL<<D3);
-	GPIO->SET[0] = (1UL<<D4);
-	GPIO->CLR[0] = (1UL<<D5);
-	GPIO->CLR[0] = (1UL<<D6);
-	GPIO->CLR[0] = (1UL<<D7);
+void markLCDDirty(void) {
+	// Called from main(); the refresh task clears lcd_dirty from the MRT ISR.
+	// PRIMASK is restored rather than cleared: boot calls this with IRQs off.
+	uint32_t primask = __get_PRIMASK();
 
-	GPIO->CLR[0] = (1UL<<EN);	//to-LOW
+	__disable_irq();
+	if (lcd_dirty == 0) {
+		lcd_dirty = 1;
+		PERIPH_Acquire(PERIPH_MRT);	// released when the panel catches up
+		LCD_StartRefresh();
+	}
+	__set_PRIMASK(primask);
 }
 
-void setLCDNewLine(void) {
-	GPIO->CLR[0] = (1UL<<RS);	//interprets as command
-	GPIO->SET[0] = (1UL<<EN);	//Start HIGH
-	delay();
+void LCD_Refresh(void) {
+	// Send at most one byte per tick: the next differing cell, preceded by a
+	// DDRAM address command when the panel's address counter is elsewhere.
+	if (lcd_dirty == 0) {
+		return;
+	}
+	if (isLCDBusy()) {	// the last byte is still being processed
+		delay_us_async(LCD_REFRESH_US, LCD_Refresh);
+		return;
+	}
+	for (uint32_t i = 0; i < (LCD_ROWS * LCD_COLS); i++) {
+		char c = lcd_shadow[i];
 
-	// Move cursor to the 2nd line
-	GPIO->CLR[0] = (1UL<<D0);
-	GPIO->CLR[0] = (1UL<<D1);
-	GPIO->CLR[0] = (1UL<<D2);
-	GPIO->CLR[0] = (1UL<<D3);
-	GPIO->CLR[0] = (1UL<<D4);
-	GPIO->CLR[0] = (1UL<<D5);
-	GPIO->SET[0] = (1UL<<D6);
-	GPIO->SET[0] = (1UL<<D7);
+		if (c != lcd_panel[i]) {
+			uint32_t addr = ((i / LCD_COLS) * LCD_ROW_STRIDE) + (i % LCD_COLS);
 
-	GPIO->CLR[0] = (1UL<<EN);	//to-LOW
+			if (addr != lcd_addr) {
+				writeLCDByte(LCD_CMD_SET_DDRAM | addr, 0);
+				lcd_addr = addr;
+			} else {
+				writeLCDByte((uint8_t)c, 1);
+				lcd_panel[i] = c;
+				lcd_addr++;
+			}
+			delay_us_async(LCD_REFRESH_US, LCD_Refresh);
+			return;
+		}
+	}
+	lcd_dirty = 0;
+	PERIPH_Release(PERIPH_MRT);
+	if (button_debounce) {	// the press that changed the panel waits on it
+		delay_us_async(BUTTON_DEBOUNCE_MS * 1000U, BUTTON_Rearm);
+	}
+}
+
+void displayON(void){
+	writeLCDByte(LCD_CMD_DISPLAY_ON, 0);
+}
+
+void clearLCDDisplay(void){
+	for (int i = 0; i < (LCD_ROWS * LCD_COLS); i++) {
+		lcd_shadow[i] = ' ';
+	}
+	lcd_cursor = 0;
+	markLCDDirty();
+}
+
+void moveLCDCursor(void){
+	lcd_cursor++;
+}
+
+void setLCDNewLine(void) {
+	// Move cursor to the 2nd line
+	lcd_cursor = LCD_COLS;
 }
 
 void setLCDInitialMsg(void){
 	//display initial message "HELLO <DRIVER NAME>"
 	clearLCDDisplay();
-	displayON();
 
 	display('H');
 	display('E');
@@ -547,6 +1695,36 @@ void setLCDRetryMsg(void) {
 	display('N');
 }
 
+void setLCDNoBreathMsg(void) {
+	//display the message "NO BREATH" / "PRESS TO RETRY"
+	clearLCDDisplay();
+
+	display('N');
+	display('O');
+	moveLCDCursor();
+	display('B');
+	display('R');
+	display('E');
+	display('A');
+	display('T');
+	display('H');
+	setLCDNewLine();
+	display('P');
+	display('R');
+	display('E');
+	display('S');
+	display('S');
+	moveLCDCursor();
+	display('T');
+	display('O');
+	moveLCDCursor();
+	display('R');
+	display('E');
+	display('T');
+	display('R');
+	display('Y');
+}
+
 void setLCDBACMsg(int bac_val){
 	//display the message "BAC LEVEL: "
 	clearLCDDisplay();
@@ -607,386 +1785,15 @@ void setLCDResultMsg(int under_limit) {
 }
 
 void displayNum(int n) {
-	GPIO->SET[0] = (1UL<<RS);	//set HIGH to interpret digital pins as data
-	GPIO->SET[0] = (1UL<<EN);	//begin HIGH to load data bits into D0-D7
-	delay();
-
-	if (n == 0) {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (n == 1) {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (n == 2) {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (n == 3) {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (n == 4) {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (n == 5) {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (n == 6) {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (n == 7) {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (n == 8) {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (n == 9) {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	}
-
-	GPIO->CLR[0] = (1UL<<EN);	//end LOW to load data bits
-
+	display('0' + n);
 }
 
 void display(char c) {
-	GPIO->SET[0] = (1UL<<RS);	//set HIGH to interpret digital pins as data
-	GPIO->SET[0] = (1UL<<EN);	//begin HIGH to load data bits into D0-D7
-	delay();
-
-	if (c == 'A') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'B') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'C') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'D') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'E') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'F') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'G') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'H') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'I') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'J') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	}
-	else if (c == 'L') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'M') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'N') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'O') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'P') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	}
-	else if (c == 'R') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'S') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'T') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'U') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'V') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'W') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'X') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == 'Y') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-		GPIO->CLR[0] = (1UL<<D5);
-		GPIO->SET[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	}
-	else if (c == '.') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == ':') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->SET[0] = (1UL<<D4);
-//		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == '!') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == '%') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->SET[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == '#') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->SET[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->CLR[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == ')') {
-		GPIO->SET[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
-	} else if (c == '(') {
-		GPIO->CLR[0] = (1UL<<D0);
-		GPIO->CLR[0] = (1UL<<D1);
-		GPIO->CLR[0] = (1UL<<D2);
-		GPIO->SET[0] = (1UL<<D3);
-		GPIO->CLR[0] = (1UL<<D4);
-		GPIO->SET[0] = (1UL<<D5);
-		GPIO->CLR[0] = (1UL<<D6);
-		GPIO->CLR[0] = (1UL<<D7);
+	// Any character of the HD44780 ROM, the byte is its code. Only the shadow
+	// is written here; LCD_Refresh() sends it to the panel.
+	if (lcd_cursor < (LCD_ROWS * LCD_COLS)) {
+		lcd_shadow[lcd_cursor] = c;
+		markLCDDirty();
 	}
-
-	GPIO->CLR[0] = (1UL<<EN);	//end LOW to load data bits
+	lcd_cursor++;
 }